@@ -33,6 +33,86 @@ int valid_size(char *p) {
 	return FALSE;
 }
 
+////////////////////////////////////////////////////////////////////// Metrics ////////////////////////
+// counters and histograms host reads from guest memory (see struct metrics_page), updating them costs no exit.
+struct metrics_page metrics __attribute__((aligned(4096)));
+struct metric *m_hypercalls, *m_fs_bytes, *m_chan_sent, *m_chan_received, *m_blk_requests, *m_task_runs;
+
+static inline void metrics_begin() {
+	metrics.seq++;
+	asm volatile("" : : : "memory"); // x86 does not reorder stores, only compiler has to be stopped.
+}
+
+static inline void metrics_end() {
+	asm volatile("" : : : "memory");
+	metrics.seq++;
+}
+
+// NULL if page is full, updates of a NULL metric do nothing.
+struct metric *metric_new(char *name, uint32_t type) {
+	if(metrics.nr == METRICS_MAX) return NULL;
+	struct metric *m = &metrics.m[metrics.nr];
+	int i;
+	for(i = 0; name[i] != '\0' && i < METRICS_NAME - 1; i++)
+		m->name[i] = name[i];
+	m->name[i] = '\0';
+	m->type = type;
+	metrics_begin();
+	metrics.nr++;
+	metrics_end();
+	return m;
+}
+
+void metric_add(struct metric *m, uint64_t val) {
+	if(m == NULL) return;
+	metrics_begin();
+	m->value += val;
+	metrics_end();
+}
+
+void metric_observe(struct metric *m, uint64_t val) {
+	int b = 0;
+	if(m == NULL) return;
+	while(b < METRICS_BUCKETS - 1 && (val >> b) != 0) // first bucket with val < 2^b.
+		b++;
+	metrics_begin();
+	m->bucket[b]++;
+	m->count++;
+	m->value += val;
+	metrics_end();
+}
+
+void metrics_init() {
+	m_hypercalls = metric_new("hypercalls_total", METRIC_COUNTER);
+	m_fs_bytes = metric_new("fs_io_bytes", METRIC_HISTOGRAM);
+	m_chan_sent = metric_new("chan_sent_total", METRIC_COUNTER);
+	m_chan_received = metric_new("chan_received_total", METRIC_COUNTER);
+	m_blk_requests = metric_new("blk_requests_total", METRIC_COUNTER);
+	m_task_runs = metric_new("task_runs_total", METRIC_COUNTER);
+	out(METRICS_PORT, (uintptr_t)&metrics);
+}
+
+////////////////////////////////////////////////////////////////////// Hypercall ABI ////////////////////////
+// file system and balloon requests go through struct hc_req (see guest-header.h), same layout for guest32 and guest64.
+// guest RAM is identity mapped so virtual addresses are passed as guest physical ones.
+struct hc_req hc;
+uint64_t hc_caps;	// granted by host on HC_HELLO.
+
+static int64_t hc_call(uint16_t op) {
+	hc.version = HC_VERSION;
+	hc.op = op;
+	hc.ret = -1; // stays if host drops the request.
+	metric_add(m_hypercalls, 1);
+	out(HC_PORT, (uintptr_t)&hc >> HC_SHIFT);
+	return hc.ret;
+}
+
+void hc_init() {
+	hc.hello.caps = HC_CAP_FS | HC_CAP_BALLOON;
+	if(hc_call(HC_HELLO) != HC_VERSION) hc.hello.caps = 0;
+	hc_caps = hc.hello.caps;
+}
+
 ////////////////////////////////////////////////////////////////////// File System ////////////////////////
 int open(char *pathname, int flags);
 int open2(char *pathname, int flags, int mode);
@@ -43,23 +123,12 @@ int close(int fd);
 int lseek(int fd, int offset, int whence);
 int get_cursor(int fd);
 int is_open(int fd);
+int copy(int fd_in, int off_in, int fd_out, int off_out, size_t len);
 
 
 
 int open(char *pathname, int flags) {
-	if(valid_size(pathname) == FALSE) {
-		display("Guest: Invalid pathname max limit 1000\n");
-		return -1;
-	}
-
-	opn.flags = flags;
-	opn.pathname = pathname;
-	opn.mode = -1;
-
-	fh.op = FS_OPEN;
-	fh.op_struct = &opn;
-	out(FS_PORT, (uintptr_t)&fh);
-	return opn.fd;
+	return open2(pathname, flags, -1);
 }
 
 int open2(char *pathname, int flags, int mode) {
@@ -67,15 +136,10 @@ int open2(char *pathname, int flags, int mode) {
 		display("Guest: Invalid pathname max limit 1000\n");
 		return -1;
 	}
-	
-	opn.pathname = pathname;
-	opn.flags = flags;
-	opn.mode = mode;
-
-	fh.op = FS_OPEN;
-	fh.op_struct = &opn;
-	out(FS_PORT, (uintptr_t)&fh);
-	return opn.fd;
+	hc.open.pathname = (uintptr_t)pathname;
+	hc.open.flags = flags;
+	hc.open.mode = mode;
+	return hc_call(FS_OPEN);
 }
 
 int creat(char *pathname, int mode) {
@@ -89,43 +153,31 @@ int read(int fd, char *buf, size_t size) {
 		display(" Bytes\n");
 		return -1;
 	}
-	rd.fd = fd;
-	rd.buf = buf;
-	rd.size = size;
-
-	fh.op = FS_READ;
-	fh.op_struct = &rd;
-	out(FS_PORT, (uintptr_t)&fh);
-	return rd.ssize;
+	hc.rw.fd = fd;
+	hc.rw.buf = (uintptr_t)buf;
+	hc.rw.count = size;
+	metric_observe(m_fs_bytes, size);
+	return hc_call(FS_READ);
 }
 
 int write(int fd, char *buf, size_t count) {
-	wr.fd = fd;
-	wr.buf = buf;
-	wr.count = count;
-
-	fh.op = FS_WRITE;
-	fh.op_struct = &wr;
-	out(FS_PORT, (uintptr_t)&fh);
-	return wr.ssize;
+	hc.rw.fd = fd;
+	hc.rw.buf = (uintptr_t)buf;
+	hc.rw.count = count;
+	metric_observe(m_fs_bytes, count);
+	return hc_call(FS_WRITE);
 }
 
 int close(int fd) {
-	fh.op = FS_CLOSE;
-	fh.fd = fd;
-	out(FS_PORT, (uintptr_t)&fh);
-	return fh.flag;
+	hc.file.fd = fd;
+	return hc_call(FS_CLOSE);
 }
 
 int lseek(int fd, int offset, int whence) {
-	lsk.fd = fd;
-	lsk.offset = offset;
-	lsk.whence = whence;
-
-	fh.op = FS_LSEEK;
-	fh.op_struct = &lsk;
-	out(FS_PORT, (uintptr_t)&fh);
-	return lsk.foffset;
+	hc.lseek.fd = fd;
+	hc.lseek.offset = offset;
+	hc.lseek.whence = whence;
+	return hc_call(FS_LSEEK);
 }
 
 int get_cursor(int fd) {
@@ -133,15 +185,232 @@ int get_cursor(int fd) {
 }
 
 int is_open(int fd) {
-	fh.op = FS_ISOPEN;
-	fh.fd = fd;
+	hc.file.fd = fd;
+	return hc_call(FS_ISOPEN);
+}
+
+int copy(int fd_in, int off_in, int fd_out, int off_out, size_t len) { // file to file copy done by host, data is not copied into guest memory so len can be more than MAX_DATA.
+	hc.copy.fd_in = fd_in;
+	hc.copy.off_in = off_in;
+	hc.copy.fd_out = fd_out;
+	hc.copy.off_out = off_out;
+	hc.copy.len = len;
+	return hc_call(FS_COPY);
+}
+
+////////////////////////////////////////////////////////////////////// Balloon ////////////////////////
+// pages of [start, start+len) are free, host takes them. returns pages taken.
+int balloon_free(void *start, size_t len) {
+	hc.balloon.op = BALLOON_FREE;
+	hc.balloon.start = (uintptr_t)start;
+	hc.balloon.len = len;
+	return hc_call(HC_BALLOON);
+}
+
+// guest wants to use the range again. contents are undefined: a page host dropped comes back zero filled, one it only marked
+// free (MADV_FREE) still has its old data if the kernel did not take it yet. initialize before use.
+int balloon_use(void *start, size_t len) {
+	hc.balloon.op = BALLOON_USE;
+	hc.balloon.start = (uintptr_t)start;
+	hc.balloon.len = len;
+	return hc_call(HC_BALLOON);
+}
+
+// number of pages host wants guest to free.
+uint32_t balloon_target() {
+	return in(BALLOON_PORT);
+}
+
+////////////////////////////////////////////////////////////////////// Channel ////////////////////////
+// ring shared with another guest, records are read and written in place (see struct chan_ring).
+#define CHAN_RING ((struct chan_ring *) CHAN_ADDR)
+
+// CHAN_NONE if host did not attach this guest to a channel.
+uint32_t chan_role() {
+	return in(CHAN_INFO);
+}
+
+void chan_doorbell() {
+	out(CHAN_DOORBELL, 1);
+}
+
+// waits a little for peer's doorbell, returns 0 if it was not rung.
+uint32_t chan_wait() {
+	return in(CHAN_WAIT);
+}
+
+// free slot to fill, NULL if ring is full.
+struct chan_record *chan_reserve() {
+	uint32_t head = CHAN_RING->head;
+	if(head - __atomic_load_n(&CHAN_RING->tail, __ATOMIC_ACQUIRE) == CHAN_SLOTS) return NULL;
+	return &CHAN_RING->rec[head & (CHAN_SLOTS - 1)];
+}
+
+// reserved slot is filled, consumer can see it now.
+void chan_commit() {
+	__atomic_store_n(&CHAN_RING->head, CHAN_RING->head + 1, __ATOMIC_RELEASE);
+	metric_add(m_chan_sent, 1);
+}
+
+// oldest record, NULL if ring is empty.
+struct chan_record *chan_peek() {
+	uint32_t tail = CHAN_RING->tail;
+	if(tail == __atomic_load_n(&CHAN_RING->head, __ATOMIC_ACQUIRE)) return NULL;
+	return &CHAN_RING->rec[tail & (CHAN_SLOTS - 1)];
+}
+
+// done with the oldest record, producer can reuse the slot.
+void chan_pop() {
+	__atomic_store_n(&CHAN_RING->tail, CHAN_RING->tail + 1, __ATOMIC_RELEASE);
+	metric_add(m_chan_received, 1);
+}
+
+////////////////////////////////////////////////////////////////////// Timer ////////////////////////
+// with in-kernel LAPIC (host -I) guest runs the x2APIC TSC deadline timer. HLT till the deadline is handled inside KVM so a
+// sleeping guest costs no exit and no host CPU. host loads an empty IDT, guest puts its handlers in it. interrupts are enabled
+// only while sleeping. 64 bit guest only, guest32 just learns if it has to leave through HALT_PORT.
+#define MSR_APIC_BASE 0x1b
+#define MSR_TSC_DEADLINE 0x6e0
+#define MSR_X2APIC_EOI 0x80b
+#define MSR_X2APIC_SVR 0x80f
+#define MSR_X2APIC_LVT_TIMER 0x832
+#define APIC_BASE_X2APIC (1 << 10)
+#define APIC_BASE_ENABLE (1 << 11)
+#define APIC_SVR_ENABLE (1 << 8)
+#define LVT_TSC_DEADLINE (2 << 17)
+#define TIMER_VECTOR 0x20
+#define SPURIOUS_VECTOR 0xff
+
+uint32_t tsc_khz;	// 0 if there is no in-kernel LAPIC.
+
+#ifdef __x86_64__
+volatile uint32_t timer_ticks;	// timer interrupts taken.
+
+struct interrupt_frame;
+
+struct idt_gate {
+	uint16_t offset0;
+	uint16_t selector;
+	uint8_t ist;
+	uint8_t type;
+	uint16_t offset1;
+	uint32_t offset2;
+	uint32_t zero;
+};
+
+static inline uint64_t rdtsc() {
+	uint32_t lo, hi;
+	asm volatile("rdtsc" : "=a"(lo), "=d"(hi));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline uint64_t rdmsr(uint32_t index) {
+	uint32_t lo, hi;
+	asm volatile("rdmsr" : "=a"(lo), "=d"(hi) : "c"(index));
+	return ((uint64_t)hi << 32) | lo;
+}
+
+static inline void wrmsr(uint32_t index, uint64_t val) {
+	asm volatile("wrmsr" : : "c"(index), "a"((uint32_t)val), "d"((uint32_t)(val >> 32)) : "memory");
+}
+
+__attribute__((interrupt)) void timer_isr(struct interrupt_frame *frame) {
+	(void)frame;
+	timer_ticks++;
+	wrmsr(MSR_X2APIC_EOI, 0);
+}
+
+__attribute__((interrupt)) void spurious_isr(struct interrupt_frame *frame) { // no EOI for spurious interrupt.
+	(void)frame;
+}
+
+void idt_set(int vector, void (*handler)(struct interrupt_frame *)) {
+	struct {
+		uint16_t limit;
+		uint64_t base;
+	} __attribute__((packed)) idtr;
+	uint16_t cs;
+	uintptr_t offset = (uintptr_t)handler;
+
+	asm volatile("sidt %0" : "=m"(idtr));
+	asm volatile("mov %%cs, %0" : "=r"(cs));
+	struct idt_gate *gate = (struct idt_gate *)idtr.base + vector;
+	gate->offset0 = offset;
+	gate->selector = cs;
+	gate->ist = 0;
+	gate->type = 0x8e;	// present, ring 0, 64 bit interrupt gate.
+	gate->offset1 = offset >> 16;
+	gate->offset2 = offset >> 32;
+	gate->zero = 0;
+}
+
+// sleeps in HLT till TSC reaches deadline.
+void sleep_until(uint64_t deadline) {
+	wrmsr(MSR_TSC_DEADLINE, deadline);
+	while(rdtsc() < deadline)
+		asm volatile("sti; hlt; cli" : : : "memory"); // interrupt can not come between sti and hlt.
+}
+
+void sleep_us(uint64_t us) {
+	sleep_until(rdtsc() + us * tsc_khz / 1000);
+}
+#endif
+
+void timer_init() {
+	tsc_khz = in(TIMER_INFO);
+#ifdef __x86_64__
+	if(tsc_khz == 0) return;
+	idt_set(TIMER_VECTOR, timer_isr);
+	idt_set(SPURIOUS_VECTOR, spurious_isr);
+	wrmsr(MSR_APIC_BASE, rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE | APIC_BASE_X2APIC);
+	wrmsr(MSR_X2APIC_SVR, APIC_SVR_ENABLE | SPURIOUS_VECTOR);
+	wrmsr(MSR_X2APIC_LVT_TIMER, LVT_TSC_DEADLINE | TIMER_VECTOR);
+#endif
+}
+
+////////////////////////////////////////////////////////////////////// Block device ////////////////////////
+// requests go to host through blkq without an exit, guest pointers are physical addresses (memory is identity mapped).
+struct blk_queue blkq __attribute__((aligned(64)));
+uint32_t blk_checked;	// requests whose status was looked at by blk_complete().
+
+// registers blkq with host, returns disk size in sectors (0 if there is no disk).
+uint64_t blk_init() {
+	blkq.sectors = 0;
+	blk_checked = blkq.avail;
+	out(BLK_PORT, (uintptr_t)&blkq);
+	return blkq.sectors;
+}
 
-	out(FS_PORT, (uintptr_t)&fh);
-	return fh.flag;
+// queues a request, returns its slot or -1 if queue is full. host sees it after blk_kick().
+int blk_submit(uint32_t op, uint64_t sector, uint32_t nr_sectors, void *buf) {
+	uint32_t avail = blkq.avail;
+	if(avail - __atomic_load_n(&blkq.used, __ATOMIC_ACQUIRE) == BLK_QUEUE_SIZE) return -1;
+	struct blk_req *req = &blkq.req[avail % BLK_QUEUE_SIZE];
+	req->op = op;
+	req->sector = sector;
+	req->nr_sectors = nr_sectors;
+	req->buf = (uintptr_t)buf;
+	__atomic_store_n(&blkq.avail, avail + 1, __ATOMIC_RELEASE);
+	metric_add(m_blk_requests, 1);
+	return avail % BLK_QUEUE_SIZE;
+}
+
+void blk_kick() {
+	out(BLK_KICK, 1);
+}
+
+// waits till host completed every queued request, returns number of them which failed.
+int blk_complete() {
+	uint32_t avail = blkq.avail;
+	int failed = 0;
+	while(__atomic_load_n(&blkq.used, __ATOMIC_ACQUIRE) != avail)
+		in(BLK_WAIT);
+	for(; blk_checked != avail; blk_checked++)
+		failed += blkq.req[blk_checked % BLK_QUEUE_SIZE].status != BLK_S_OK;
+	return failed;
 }
 
 int rename();
-int copy();
 int remove();
 int dup();
 int dup2();
@@ -246,11 +515,216 @@ void test_write() {
 
 }
 
+void test_copy() {
+	int fd_in = open("test-files/myfile.txt", OPN_RDONLY);
+	if(fd_in < 0) {
+		display("GUEST: Error opening file\n");
+		return;
+	}
+	int fd_out = creat("test-files/c_myfile.txt", M_IRWXU);
+	if(fd_out < 0) {
+		display("GUEST: Error creating file\n");
+		close(fd_in);
+		return;
+	}
+	int ssize = copy(fd_in, 0, fd_out, 0, 1 << 20); // whole file in one exit, copy stops at EOF of input.
+	if(ssize < 0) {
+		display("GUEST: Error copying file\n");
+	} else {
+		display("GUEST: copied bytes:");
+		printVal(ssize);
+	}
+	if(close(fd_in) != 0 || close(fd_out) != 0) {
+		display("GUEST: Error while closing file\n");
+	}
+}
+
+#define BALLOON_AREA ((char *)0x100000) // 1MB to 1.5MB is not used by guest code, data or stack.
+#define BALLOON_AREA_SIZE 0x80000
+
+void part_D() {
+	if(!(hc_caps & HC_CAP_BALLOON)) return;
+	display("|-----------Inside Part D ----------|\n");
+
+	for(int i = 0; i < BALLOON_AREA_SIZE; i += 4096) // use the pages so host has to allocate them.
+		BALLOON_AREA[i] = 1;
+	display("GUEST: balloon target pages:");
+	printVal(balloon_target());
+	display("GUEST: pages given to host:");
+	printVal(balloon_free(BALLOON_AREA, BALLOON_AREA_SIZE));
+	display("GUEST: pages taken back:");
+	printVal(balloon_use(BALLOON_AREA, BALLOON_AREA_SIZE / 2));
+
+	display("|-----------Leaving Part D ----------|\n");
+}
+
+#define CHAN_MESSAGES 50000
+#define CHAN_BATCH 64		// doorbell is rung once per this many records.
+#define CHAN_MAX_WAITS 5000	// waits in a row without progress before peer is given up.
+
+void chan_produce() {
+	int waits = 0;
+	for(uint32_t i = 0; i < CHAN_MESSAGES; ) {
+		struct chan_record *rec = chan_reserve();
+		if(rec == NULL) { // full, wake consumer and wait till it makes room.
+			chan_doorbell();
+			if(chan_wait() == 0 && ++waits == CHAN_MAX_WAITS) {
+				display("GUEST: channel consumer is not reading\n");
+				return;
+			}
+			continue;
+		}
+		waits = 0;
+		*(uint32_t *)rec->data = i;
+		rec->len = sizeof(uint32_t);
+		chan_commit();
+		if(++i % CHAN_BATCH == 0) chan_doorbell();
+	}
+	chan_doorbell();
+	display("GUEST: channel records sent:");
+	printVal(CHAN_MESSAGES);
+}
+
+void chan_consume() {
+	uint32_t got = 0, sum = 0;
+	int waits = 0;
+	while(got < CHAN_MESSAGES) {
+		struct chan_record *rec = chan_peek();
+		if(rec == NULL) { // empty, wait for producer.
+			if(chan_wait() == 0 && ++waits == CHAN_MAX_WAITS) {
+				display("GUEST: channel producer is not writing\n");
+				return;
+			}
+			continue;
+		}
+		waits = 0;
+		if(rec->len != sizeof(uint32_t) || *(uint32_t *)rec->data != got) {
+			display("GUEST: channel record out of order\n");
+			return;
+		}
+		sum += *(uint32_t *)rec->data;
+		chan_pop();
+		if(++got % CHAN_BATCH == 0) chan_doorbell();
+	}
+	chan_doorbell();
+	display("GUEST: channel records received:");
+	printVal(got);
+	display("GUEST: channel records sum:");
+	printVal(sum);
+}
+
+void part_E() {
+	uint32_t role = chan_role();
+	if(role == CHAN_NONE) return;
+
+	display("|-----------Inside Part E ----------|\n");
+	if(role == CHAN_PRODUCER) chan_produce();
+	else chan_consume();
+	display("|-----------Leaving Part E ----------|\n");
+}
+
+#define BLK_TEST_SECTORS 8
+char blk_buf[BLK_TEST_SECTORS * BLK_SECTOR] __attribute__((aligned(4096)));
+
+void part_F() {
+	uint64_t sectors = blk_init();
+	if(sectors == 0) return;
+
+	display("|-----------Inside Part F ----------|\n");
+	display("GUEST: disk sectors:");
+	printVal(sectors);
+	if(sectors < BLK_TEST_SECTORS) {
+		display("GUEST: disk too small\n");
+		return;
+	}
+	// one request per sector but a single kick, host writes them with one pwritev.
+	for(int i = 0; i < BLK_TEST_SECTORS; i++) {
+		for(int j = 0; j < BLK_SECTOR; j++)
+			blk_buf[i * BLK_SECTOR + j] = 'a' + i;
+		blk_submit(BLK_WRITE, i, 1, blk_buf + i * BLK_SECTOR);
+	}
+	blk_submit(BLK_FLUSH, 0, 0, NULL);
+	blk_kick();
+	display("GUEST: disk write failures:");
+	printVal(blk_complete());
+
+	for(int i = 0; i < BLK_TEST_SECTORS * BLK_SECTOR; i++)
+		blk_buf[i] = 0;
+	blk_submit(BLK_READ, 0, BLK_TEST_SECTORS, blk_buf);
+	blk_kick();
+	display("GUEST: disk read failures:");
+	printVal(blk_complete());
+	int bad = 0;
+	for(int i = 0; i < BLK_TEST_SECTORS * BLK_SECTOR; i++)
+		bad += blk_buf[i] != 'a' + i / BLK_SECTOR;
+	display(bad == 0 ? "GUEST: disk data ok\n" : "GUEST: disk data mismatch\n");
+	display("|-----------Leaving Part F ----------|\n");
+}
+
+#ifdef __x86_64__
+struct task {	// runs every period, tasks share the vcpu and it sleeps between them.
+	void (*run)(struct task *);
+	uint64_t period;	// in TSC ticks.
+	uint64_t next;		// TSC deadline of next run.
+	uint32_t runs;
+};
+
+void task_count(struct task *t) {
+	(void)t;
+	metric_add(m_task_runs, 1);
+}
+
+void run_tasks(struct task *tasks, int n, uint64_t until) {
+	for(;;) {
+		struct task *t = &tasks[0];
+		for(int i = 1; i < n; i++)
+			if(tasks[i].next < t->next) t = &tasks[i];
+		if(t->next >= until) return;
+		sleep_until(t->next);
+		t->run(t);
+		t->runs++;
+		t->next += t->period;
+	}
+}
+#endif
+
+void part_G() {
+#ifdef __x86_64__
+	if(tsc_khz == 0) return;
+
+	display("|-----------Inside Part G ----------|\n");
+	display("GUEST: TSC kHz:");
+	printVal(tsc_khz);
+	uint64_t start = rdtsc();
+	uint32_t ticks = timer_ticks;
+	for(int i = 0; i < 10; i++)
+		sleep_us(1000);
+	display("GUEST: slept 10 x 1 ms, timer interrupts:");
+	printVal(timer_ticks - ticks);
+	display("GUEST: elapsed us:");
+	printVal((rdtsc() - start) * 1000 / tsc_khz);
+
+	uint64_t now = rdtsc(), ms = tsc_khz;
+	struct task tasks[2] = {
+		{ task_count, 2 * ms, now + 2 * ms, 0 },
+		{ task_count, 5 * ms, now + 5 * ms, 0 },
+	};
+	run_tasks(tasks, 2, now + 20 * ms);
+	display("GUEST: in 20 ms 2 ms task ran:");
+	printVal(tasks[0].runs);
+	display("GUEST: in 20 ms 5 ms task ran:");
+	printVal(tasks[1].runs);
+	display("|-----------Leaving Part G ----------|\n");
+#endif
+}
+
 void part_C() {
+	if(!(hc_caps & HC_CAP_FS)) return;
 	display("|-----------Inside Part C ----------|\n");
 	
 	test_read();
 	test_write();
+	test_copy();
 
 	display("\n|-----------Leaving Part C ----------|\n");
 }
@@ -264,11 +738,19 @@ __attribute__((noreturn))
 __attribute__((section(".start")))
 _start(void) {
 	
+	metrics_init();
+	hc_init();
+	timer_init();
 	part_A();
 	part_B();
 	part_C();
+	part_D();
+	part_E();
+	part_F();
+	part_G();
 
 	*(long *) 0x400 = 42; // storing 42 at 0x400 pointer address. NOTE: for guest program it is his virtual address. pointer address is always virtual address.
+	if(tsc_khz != 0) out(HALT_PORT, 42); // KVM keeps our HLT to itself when it has the LAPIC. eax is 42 like after the HLT below.
 
 	for (;;)
 		asm("hlt" : /* empty */ : "a" (42) : "memory");
@@ -0,0 +1,194 @@
+// kvm-dump: prints a crash dump kvm-hello-world wrote for a guest it had to stop (see "Crash dumps" in kvm-hello-world.c).
+//   ./kvm-dump file              exit, registers, segments, RAM present in the dump and code at guest's RIP
+//   ./kvm-dump file gva [len]    hex dump of guest memory at a guest virtual address (translated with guest's page tables)
+//   ./kvm-dump file -p gpa [len] same at a guest physical address
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/kvm.h>
+#include "kvm-header.h"
+
+#define CR0_PG (1U << 31)
+#define CR4_PSE (1U << 4)
+#define CR4_PAE (1U << 5)
+#define EFER_LMA (1U << 10)
+#define PTE_PRESENT 1
+#define PTE_PS (1U << 7)
+#define PTE_ADDR 0x000ffffffffff000ull
+
+int dump_fd;
+struct crash_hdr hdr;
+
+const char *exit_names[] = {
+	[KVM_EXIT_UNKNOWN] = "UNKNOWN", [KVM_EXIT_EXCEPTION] = "EXCEPTION", [KVM_EXIT_IO] = "IO", [KVM_EXIT_HYPERCALL] = "HYPERCALL",
+	[KVM_EXIT_DEBUG] = "DEBUG", [KVM_EXIT_HLT] = "HLT", [KVM_EXIT_MMIO] = "MMIO", [KVM_EXIT_IRQ_WINDOW_OPEN] = "IRQ_WINDOW_OPEN",
+	[KVM_EXIT_SHUTDOWN] = "SHUTDOWN (triple fault)", [KVM_EXIT_FAIL_ENTRY] = "FAIL_ENTRY", [KVM_EXIT_INTR] = "INTR",
+	[KVM_EXIT_SET_TPR] = "SET_TPR", [KVM_EXIT_TPR_ACCESS] = "TPR_ACCESS", [KVM_EXIT_NMI] = "NMI",
+	[KVM_EXIT_INTERNAL_ERROR] = "INTERNAL_ERROR", [KVM_EXIT_SYSTEM_EVENT] = "SYSTEM_EVENT",
+};
+
+// reads guest physical memory, holes of the sparse file read as zero. returns 0 if it is outside guest RAM.
+int read_gpa(uint64_t gpa, void *buf, size_t len) {
+	if (gpa >= hdr.mem_size || len > hdr.mem_size - gpa) return 0;
+	return pread(dump_fd, buf, len, CRASH_DATA_OFFSET + gpa) == (ssize_t)len;
+}
+
+// walks guest's page tables like the MMU would for the paging mode sregs are in. returns 0 if gva is not mapped.
+int gva_to_gpa(uint64_t gva, uint64_t *gpa) {
+	const struct kvm_sregs *s = &hdr.sregs;
+	uint64_t table, entry = 0;
+
+	if (!(s->cr0 & CR0_PG)) {
+		*gpa = gva;
+		return 1;
+	}
+	if (!(s->cr4 & CR4_PAE)) { // 32 bit paging, 4 byte entries, 4 MB pages with PSE.
+		uint32_t e32;
+		if (!read_gpa((s->cr3 & 0xfffff000) + ((gva >> 22) & 0x3ff) * 4, &e32, 4) || !(e32 & PTE_PRESENT)) return 0;
+		if ((e32 & PTE_PS) && (s->cr4 & CR4_PSE)) {
+			*gpa = (e32 & 0xffc00000) | (gva & 0x3fffff);
+			return 1;
+		}
+		if (!read_gpa((e32 & 0xfffff000) + ((gva >> 12) & 0x3ff) * 4, &e32, 4) || !(e32 & PTE_PRESENT)) return 0;
+		*gpa = (e32 & 0xfffff000) | (gva & 0xfff);
+		return 1;
+	}
+	int shift = 39;	// 4 level with EFER.LMA, PAE starts at its 4 entry PDPT.
+	table = s->cr3 & PTE_ADDR;
+	if (!(s->efer & EFER_LMA)) {
+		shift = 30;
+		table = s->cr3 & 0xffffffe0;
+	}
+	for (; shift >= 12; shift -= 9) {
+		if (!read_gpa(table + ((gva >> shift) & 0x1ff) * 8, &entry, 8) || !(entry & PTE_PRESENT)) return 0;
+		if (shift == 12 || ((entry & PTE_PS) && (shift == 21 || (shift == 30 && (s->efer & EFER_LMA))))) break; // large page.
+		table = entry & PTE_ADDR;
+	}
+	*gpa = (entry & PTE_ADDR & ~((1ull << shift) - 1)) | (gva & ((1ull << shift) - 1));
+	return 1;
+}
+
+// bytes are looked up one by one so a line may cross into a page which is not mapped, those print as "--".
+void hexdump(uint64_t addr, int virt, size_t len) {
+	for (size_t off = 0; off < len; off += 16) {
+		size_t n = len - off < 16 ? len - off : 16;
+		uint8_t line[16];
+		int ok[16];
+
+		for (size_t i = 0; i < n; i++) {
+			uint64_t gpa = addr + off + i;
+			ok[i] = (!virt || gva_to_gpa(addr + off + i, &gpa)) && read_gpa(gpa, &line[i], 1);
+		}
+		printf("%016lx ", addr + off);
+		for (size_t i = 0; i < 16; i++) {
+			if (i >= n) printf("   ");
+			else if (ok[i]) printf(" %02x", line[i]);
+			else printf(" --");
+		}
+		printf("  ");
+		for (size_t i = 0; i < n; i++)
+			putchar(ok[i] && line[i] >= 0x20 && line[i] < 0x7f ? line[i] : '.');
+		putchar('\n');
+	}
+}
+
+void print_seg(const char *name, const struct kvm_segment *sg) {
+	printf("  %-4s sel %04x base %016llx limit %08x type %x dpl %u %s%s%s\n", name, sg->selector, sg->base, sg->limit,
+	       sg->type, sg->dpl, sg->present ? "P" : "-", sg->l ? " L" : "", sg->db ? " DB" : "");
+}
+
+void print_exit() {
+	const char *name = hdr.exit_reason < sizeof(exit_names) / sizeof(exit_names[0]) && exit_names[hdr.exit_reason] != NULL
+			   ? exit_names[hdr.exit_reason] : "?";
+	time_t t = hdr.time_ns / 1000000000;
+	char when[64];
+
+	strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&t));
+	printf("VM %u stopped at %s after %lu exits: exit reason %u %s\n", hdr.vm_id, when, hdr.exits, hdr.exit_reason, name);
+	if (hdr.exit_reason == KVM_EXIT_INTERNAL_ERROR && hdr.ninfo > 0) {
+		printf("  suberror %lu", hdr.info[0]);
+		for (uint32_t i = 1; i < hdr.ninfo; i++)
+			printf(" data[%u] %lx", i - 1, hdr.info[i]);
+		putchar('\n');
+	} else if (hdr.exit_reason == KVM_EXIT_FAIL_ENTRY && hdr.ninfo >= 2) {
+		printf("  hardware entry failure reason %lx on cpu %lu\n", hdr.info[0], hdr.info[1]);
+	} else if (hdr.exit_reason == KVM_EXIT_IO && hdr.ninfo >= 4) {
+		printf("  %s of %lu bytes on port %lx (count %lu) host does not serve\n", hdr.info[0] == KVM_EXIT_IO_OUT ? "OUT" : "IN",
+		       hdr.info[1], hdr.info[2], hdr.info[3]);
+	}
+}
+
+void print_regs() {
+	const struct kvm_regs *r = &hdr.regs;
+	const struct kvm_sregs *s = &hdr.sregs;
+	const char *mode = !(s->cr0 & 1) ? "real" : !(s->cr0 & CR0_PG) ? "protected" : (s->efer & EFER_LMA) ? "long" : "paged";
+
+	printf("registers (%s mode):\n", mode);
+	printf("  rax %016llx rbx %016llx rcx %016llx rdx %016llx\n", r->rax, r->rbx, r->rcx, r->rdx);
+	printf("  rsi %016llx rdi %016llx rsp %016llx rbp %016llx\n", r->rsi, r->rdi, r->rsp, r->rbp);
+	printf("  r8  %016llx r9  %016llx r10 %016llx r11 %016llx\n", r->r8, r->r9, r->r10, r->r11);
+	printf("  r12 %016llx r13 %016llx r14 %016llx r15 %016llx\n", r->r12, r->r13, r->r14, r->r15);
+	printf("  rip %016llx rflags %016llx\n", r->rip, r->rflags);
+	printf("  cr0 %016llx cr2 %016llx cr3 %016llx cr4 %016llx\n", s->cr0, s->cr2, s->cr3, s->cr4);
+	printf("  cr8 %016llx efer %016llx apic_base %016llx\n", s->cr8, s->efer, s->apic_base);
+	print_seg("cs", &s->cs);
+	print_seg("ds", &s->ds);
+	print_seg("es", &s->es);
+	print_seg("fs", &s->fs);
+	print_seg("gs", &s->gs);
+	print_seg("ss", &s->ss);
+	print_seg("tr", &s->tr);
+	print_seg("ldt", &s->ldt);
+	printf("  gdt base %016llx limit %04x, idt base %016llx limit %04x\n", s->gdt.base, s->gdt.limit, s->idt.base, s->idt.limit);
+	for (int i = 0; i < (KVM_NR_INTERRUPTS + 63) / 64; i++)
+		if (s->interrupt_bitmap[i] != 0) printf("  pending interrupts %d-%d: %016llx\n", i * 64, i * 64 + 63, s->interrupt_bitmap[i]);
+}
+
+void print_ram() { // data extents of the sparse file are the pages host wrote.
+	off_t end = CRASH_DATA_OFFSET + hdr.mem_size;
+	printf("guest RAM %lu KB, %lu KB in dump%s:\n", hdr.mem_size / 1024, hdr.pages * 4, hdr.pages == 0 ? " (cut short?)" : "");
+	for (off_t data = CRASH_DATA_OFFSET, hole; (data = lseek(dump_fd, data, SEEK_DATA)) >= 0 && data < end; data = hole) {
+		hole = lseek(dump_fd, data, SEEK_HOLE);
+		if (hole < 0 || hole > end) hole = end;
+		printf("  gpa %08lx-%08lx\n", data - CRASH_DATA_OFFSET, hole - CRASH_DATA_OFFSET);
+	}
+}
+
+int main(int argc, char **argv) {
+	int phys = argc > 2 && strcmp(argv[2], "-p") == 0;
+	char **addr_arg = argv + 2 + phys;
+
+	if (argc < 2 || (phys && argc < 4)) {
+		fprintf(stderr, "Usage: %s dump_file [ [ -p ] address [ len ] ]\n", argv[0]);
+		return 1;
+	}
+	dump_fd = open(argv[1], O_RDONLY);
+	if (dump_fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	if (pread(dump_fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) || memcmp(hdr.magic, CRASH_MAGIC, sizeof(hdr.magic)) != 0
+	    || hdr.version != CRASH_VERSION || hdr.ninfo > CRASH_INFO_MAX) {
+		fprintf(stderr, "%s: not a version %d crash dump\n", argv[1], CRASH_VERSION);
+		return 1;
+	}
+
+	if (argc > 2 + phys) {
+		uint64_t addr = strtoull(addr_arg[0], NULL, 0);
+		size_t len = argc > 3 + phys ? strtoull(addr_arg[1], NULL, 0) : 64;
+		hexdump(addr, !phys, len);
+		return 0;
+	}
+	print_exit();
+	print_regs();
+	print_ram();
+	uint64_t rip = hdr.sregs.cs.base + hdr.regs.rip;
+	printf("code at cs:rip (%lx):\n", rip);
+	hexdump(rip, 1, 32);
+	return 0;
+}
@@ -4,6 +4,17 @@
 #define OUT_PORT 0x3201
 #define IN_PORT 0x3200
 #define FS_PORT 0xFF00
+#define BALLOON_PORT 0xFF01
+#define CHAN_INFO 0xFF02	// IN: role of this guest on its channel.
+#define CHAN_DOORBELL 0xFF03	// OUT: wake up the peer, handled inside KVM (ioeventfd) so VM host does not see an exit.
+#define CHAN_WAIT 0xFF04	// IN: wait for peer's doorbell, returns doorbells rung since last wait, 0 on timeout.
+#define BLK_PORT 0xFF05		// OUT: guest physical address of struct blk_queue, host fills in disk size.
+#define BLK_KICK 0xFF06		// OUT: new requests in queue, handled inside KVM (ioeventfd).
+#define BLK_WAIT 0xFF07		// IN: wait for completions, returns batches completed since last wait, 0 on timeout.
+#define HC_PORT 0xFF08		// OUT: guest physical address of struct hc_req >> HC_SHIFT.
+#define METRICS_PORT 0xFF09	// OUT: guest physical address of struct metrics_page, host reads it from then on.
+#define TIMER_INFO 0xFF0A	// IN: TSC kHz if guest has in-kernel LAPIC (x2APIC with TSC deadline timer), 0 if not.
+#define HALT_PORT 0xFF0B	// OUT: guest is done. with in-kernel LAPIC its HLT never reaches host.
 
 #define TRUE 1
 #define FALSE 0
@@ -13,6 +24,56 @@
 #define FS_LSEEK 3
 #define FS_CLOSE 4
 #define FS_ISOPEN 5
+#define FS_COPY 6
+
+// ****** for hypercall ABI ******
+// struct hc_req has the same layout in guest32 and guest64: fixed width fields at their natural alignment, addresses are 64 bit
+// guest physical. it is 64 byte aligned so 32 bit OUT on HC_PORT carries its address >> HC_SHIFT (requests in first 256 GB).
+// guest starts with HC_HELLO: host answers with its version in ret and grants the capabilities it has out of those asked for.
+// other ops are FS_* (same numbers) and HC_BALLOON, host fails them with -1 if their capability was not granted.
+#define HC_VERSION 1
+#define HC_SHIFT 6
+#define HC_BALLOON 7
+#define HC_HELLO 8
+#define HC_CAP_FS (1 << 0)	// FS_* ops.
+#define HC_CAP_BALLOON (1 << 1)	// HC_BALLOON.
+
+// ****** for metrics ******
+// guest keeps counters and histograms in struct metrics_page in its RAM and updates them with plain stores, host reads the page
+// from a thread so an update costs no exit. guest adds a metric by filling slot nr and then incrementing nr. every change is
+// made between two increments of seq (odd while changing), host copies the page till it sees the same even seq before and after.
+#define METRICS_MAX 16
+#define METRICS_NAME 32		// [a-zA-Z0-9_], '\0' terminated.
+#define METRICS_BUCKETS 16	// histogram bucket i counts values below 2^i, last bucket counts the rest.
+#define METRIC_COUNTER 1
+#define METRIC_HISTOGRAM 2
+
+// ****** for balloon ******
+#define BALLOON_FREE 0	// range is free, host can take the pages.
+#define BALLOON_USE 1	// guest takes pages of range back, their contents are undefined (zero or old data).
+
+// ****** for channel ******
+// two guests share CHAN_SIZE bytes of memory at guest physical address CHAN_ADDR (guest maps it at same virtual address).
+// it holds a single producer single consumer ring of fixed size records.
+#define CHAN_NONE 0
+#define CHAN_PRODUCER 1
+#define CHAN_CONSUMER 2
+#define CHAN_ADDR 0x40000000
+#define CHAN_SIZE 0x200000
+#define CHAN_SLOTS 16384	// power of 2.
+#define CHAN_RECORD 60
+
+// ****** for block device ******
+// disk is served by a host I/O thread from a queue in guest memory: guest fills req[avail % BLK_QUEUE_SIZE], increments avail
+// and kicks. host completes requests in batches, sets their status and then moves used up to avail. addresses are guest physical.
+#define BLK_SECTOR 512		// buffers and sizes must be multiples of it (disk may be opened with O_DIRECT).
+#define BLK_QUEUE_SIZE 64	// at most this many requests in flight.
+#define BLK_READ 0
+#define BLK_WRITE 1
+#define BLK_FLUSH 2
+#define BLK_S_OK 0
+#define BLK_S_IOERR 1
+#define BLK_S_UNSUPP 2
 
 // ****** for open ******
 #define OPN_RDONLY	1<<0
@@ -44,6 +105,7 @@
 
 char data[MAX_DATA];
 
+// first ABI, FS_PORT and BALLOON_PORT. pointers and size_t make layout differ between guest32 and guest64, use struct hc_req.
 struct file_handler {
 	int op;
 	int fd;
@@ -82,4 +144,142 @@ struct lseek_file {
 	int whence;
 	// return
 	int foffset;
-} lsk;
\ No newline at end of file
+} lsk;
+
+struct copy_file {
+	int fd_in;
+	int off_in;	// -1 means use (and advance) the current file offset.
+	int fd_out;
+	int off_out;
+	size_t len;
+	// return
+	int ssize;
+} cpy;
+
+struct balloon_req {
+	int op;
+	void *start;
+	size_t len;
+	// return
+	int pages;	// pages host took (BALLOON_FREE) or gave back (BALLOON_USE).
+} bln;
+
+struct hc_req {
+	uint16_t version;	// HC_VERSION guest was built with, host refuses other versions.
+	uint16_t op;
+	uint32_t pad;
+	int64_t ret;		// set by host: result of op, -1 on error.
+	union {
+		struct {
+			uint64_t caps;		// guest: capabilities it wants. host: capabilities granted.
+		} hello;
+		struct {
+			uint64_t pathname;
+			int32_t flags;
+			int32_t mode;		// -1 if not given.
+		} open;
+		struct {			// FS_READ, FS_WRITE.
+			uint64_t buf;
+			uint64_t count;
+			int32_t fd;
+			int32_t pad;
+		} rw;
+		struct {
+			int64_t offset;
+			int32_t fd;
+			int32_t whence;
+		} lseek;
+		struct {			// FS_CLOSE, FS_ISOPEN.
+			int32_t fd;
+			int32_t pad;
+		} file;
+		struct {
+			int64_t off_in;		// -1 means use (and advance) the current file offset.
+			int64_t off_out;
+			uint64_t len;
+			int32_t fd_in;
+			int32_t fd_out;
+		} copy;
+		struct {
+			uint64_t start;
+			uint64_t len;
+			int32_t op;		// BALLOON_FREE or BALLOON_USE.
+			int32_t pad;
+		} balloon;
+	};
+} __attribute__((aligned(1 << HC_SHIFT)));
+
+_Static_assert(sizeof(struct hc_req) == 64, "struct hc_req must be the same in guest32, guest64 and host");
+
+struct metric {
+	char name[METRICS_NAME];
+	uint32_t type;
+	uint32_t pad;
+	uint64_t value;		// counter value, sum of observed values for histogram.
+	uint64_t count;		// histogram: values observed.
+	uint64_t bucket[METRICS_BUCKETS];
+};
+
+struct metrics_page {
+	uint32_t seq;
+	uint32_t nr;		// slots in use.
+	struct metric m[METRICS_MAX];
+};
+
+_Static_assert(sizeof(struct metrics_page) <= 4096, "struct metrics_page must fit in a page");
+
+struct chan_record {
+	uint32_t len;
+	char data[CHAN_RECORD];
+};
+
+struct chan_ring {
+	uint32_t head;	// next slot producer fills, only producer writes it. both ends access head and tail with __atomic builtins.
+	uint32_t pad0[15];	// head and tail are on different cache lines.
+	uint32_t tail;	// next slot consumer reads, only consumer writes it.
+	uint32_t pad1[15];
+	struct chan_record rec[CHAN_SLOTS];
+};
+
+struct blk_req {
+	uint32_t op;
+	uint32_t nr_sectors;
+	uint64_t sector;
+	uint64_t buf;		// guest physical address.
+	uint32_t status;	// set by host before used passes this request.
+	uint32_t pad;
+};
+
+struct blk_queue {
+	uint32_t avail;	// requests added by guest, only guest writes it. both ends access avail and used with __atomic builtins.
+	uint32_t pad0[15];
+	uint32_t used;	// requests completed by host, only host writes it.
+	uint32_t pad1[15];
+	uint64_t sectors;	// disk size, set by host on BLK_PORT, 0 if there is no disk.
+	struct blk_req req[BLK_QUEUE_SIZE];
+};
+// ****** for crash dump ******
+// not guest ABI: file host writes when a guest stops on an exit it can not handle, read by kvm-dump. needs <linux/kvm.h>.
+// struct crash_hdr is followed by guest RAM at CRASH_DATA_OFFSET, byte at guest physical address gpa is at
+// CRASH_DATA_OFFSET + gpa. only non-zero pages are written, the rest are holes of the sparse file and read as zero.
+#define CRASH_MAGIC "KVMHCORE"
+#define CRASH_VERSION 1
+#define CRASH_DATA_OFFSET 4096
+#define CRASH_INFO_MAX 16
+
+struct crash_hdr {
+	char magic[8];
+	uint32_t version;
+	uint32_t exit_reason;	// KVM_EXIT_*, KVM_EXIT_IO for a port host does not serve.
+	uint32_t vm_id;
+	uint32_t ninfo;		// used entries of info.
+	uint64_t mem_size;	// bytes of guest RAM after the header.
+	uint64_t pages;		// non-zero pages written, 0 while RAM is still being written.
+	uint64_t time_ns;	// CLOCK_REALTIME of the exit.
+	uint64_t exits;		// exits guest had made.
+	uint64_t info[CRASH_INFO_MAX];	// what kvm_run says about the exit: internal.suberror and data[], fail_entry reason and
+					// cpu, io direction, size, port and count.
+	struct kvm_regs regs;
+	struct kvm_sregs sregs;
+};
+_Static_assert(sizeof(struct crash_hdr) <= CRASH_DATA_OFFSET, "struct crash_hdr must fit before guest RAM");
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
@@ -7,9 +8,64 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <linux/userfaultfd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <linux/mempolicy.h>
+#include <elf.h>
 #include <linux/kvm.h>
 #include "kvm-header.h"
 
+// USDT probes for perf/bpftrace (provider kvm_hello, "bpftrace -l 'usdt:./kvm-hello-world:*'"), so host exit handling can be
+// lined up with kernel's kvm:kvm_exit/kvm:kvm_entry. a probe is one NOP until a tracer attaches, arguments are only evaluated
+// into registers. without sys/sdt.h (systemtap-sdt-dev) probes compile to nothing.
+//   run_entry(vm, vcpu_fd)  run_exit(vm, exit_reason)  io(vm, port, direction, size)
+//   fs_start(vm, fh_gva)    fs_end(vm, op, guest_fd, size, result)
+#if defined(__has_include) && __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define PROBE(name, ...) STAP_PROBEV(kvm_hello, name, __VA_ARGS__)
+#else
+#define PROBE(name, ...) do { } while (0)
+#endif
+
+// compile-time features, everything is built in by default. make FEATURES="-DCONFIG_DEBUG=0 -DCONFIG_MODES=8 ..." (see Makefile).
+// a feature left out is tested with a plain if () rather than #if so its code is still compiled and type checked, the optimizer
+// drops the branches and its handlers are left unreferenced (the -flto release build removes them from the binary).
+#ifndef CONFIG_MODES
+#define CONFIG_MODES 0xf	// bit per enum vm_mode: 1 real, 2 protected, 4 paged, 8 long.
+#endif
+#ifndef CONFIG_FS
+#define CONFIG_FS 1		// file hypercalls (FS_PORT, HC_PORT file operations).
+#endif
+#ifndef CONFIG_BALLOON
+#define CONFIG_BALLOON 1	// free page reporting and -B.
+#endif
+#ifndef CONFIG_CHAN
+#define CONFIG_CHAN 1		// channels between guests, chan=N in manifest.
+#endif
+#ifndef CONFIG_BLK
+#define CONFIG_BLK 1		// block device, -d and disk=image in manifest.
+#endif
+#ifndef CONFIG_TRACE
+#define CONFIG_TRACE 1		// exit record/replay, -o/-i.
+#endif
+#ifndef CONFIG_DEBUG
+#define CONFIG_DEBUG 1		// host chatter: load addresses, file table dumps, result of every file operation.
+#endif
+
+#define debug_printf(...) do { if (CONFIG_DEBUG) printf(__VA_ARGS__); } while (0)
+
 /* CR0 bits */
 #define CR0_PE 1u
 #define CR0_MP (1U << 1)
@@ -64,25 +120,197 @@
 #define PDE64_PS (1U << 7)
 #define PDE64_G (1U << 8)
 
+#define PAGE_SHIFT 12
+#define PAGE_SIZE ((uint64_t)1 << PAGE_SHIFT)
+
+// guest page tables are built here, above the balloon area and below the stack. (at 0x2000 they were under guest64 bss.)
+#define PT_BASE 0x180000
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23	// linux 5.14, older kernels return EINVAL and pages are touched one by one.
+#endif
+
+
+struct vm_stats {	// per VM counters, printed at the end of run.
+	uint64_t exits;		// all exits including HLT.
+	uint64_t io_exits;
+	uint64_t fs_ops;	// file system hypercalls, FS_PORT or HC_PORT.
+	uint64_t run_ns;	// wall time from first KVM_RUN till guest halted.
+	uint64_t first_exit_ns;	// first KVM_RUN till first exit, guest page faults on startup land here.
+	uint64_t minflt, majflt;	// host page faults taken by the vcpu thread while running this guest.
+	uint64_t balloon_ops;	// balloon hypercalls, BALLOON_PORT or HC_PORT.
+	uint64_t balloon_freed;	// pages dropped with MADV_DONTNEED (host asked for them).
+	uint64_t balloon_lazy;	// pages reported free by guest on its own, MADV_FREE so kernel takes them only under pressure.
+	uint64_t balloon_used;	// pages guest took back (deflate).
+	uint64_t chan_waits;	// CHAN_WAIT hypercalls.
+	uint64_t chan_timeouts;	// CHAN_WAIT which returned without a doorbell.
+	uint64_t blk_reqs;	// block requests completed, by I/O thread.
+	uint64_t blk_syscalls;	// preadv/pwritev/fdatasync done for them.
+	uint64_t blk_batches;	// completions published.
+	uint64_t resets;
+	uint64_t reset_ns;	// time spent in vm_reset().
+	uint64_t reset_dropped;	// pages given back to kernel by resets.
+	uint64_t reset_copied;	// pristine pages copied back by resets.
+	uint64_t dedup_scans;
+	uint64_t dedup_scan_ns;	// time spent in dedup_scan().
+	uint64_t dedup_hashed;	// pages hashed by scans.
+	uint64_t dedup_merged;	// pages mapped from a shared page now, not a counter.
+	uint64_t throttled;	// FS hypercalls put off because a -L limit was used up.
+	uint64_t throttle_ns;	// time they were put off.
+	uint64_t fq_waits;	// file operations which waited in the fair queue (-Q).
+	uint64_t fq_wait_ns;
+	uint64_t lazy_faults;	// missing pages served by lazy restore handler,
+	uint64_t lazy_image_faults;	// with content of guest image (the others are zero).
+	uint64_t lazy_fault_ns;	// handler time for them.
+	uint64_t lazy_prefetched;	// pages served ahead of faults from recorded fault order.
+};
+
+struct token_bucket {
+	double tokens;		// negative when in debt, requests are put off till it is back to 0.
+	uint64_t last_ns;	// last refill, 0 = bucket is not used yet.
+};
+
+struct vm_io {	// state of -L limits and -Q fair queue of a VM.
+	struct token_bucket hc, bytes, iops;
+	uint64_t until;		// FS hypercall, CHAN_WAIT or BLK_WAIT in kvm_run is put off till then, 0 if none.
+	uint64_t fq_finish;	// finish tag of last request in fair queue.
+};
 
 struct vm {
 	int sys_fd;
 	int fd;
 	char *mem;
+	size_t mem_size;
+	int id;
+	struct open_file_entry *file;	// open file table of this guest, see fs_init().
+	int file_table_len;
+	uint64_t balloon_target;	// pages host wants guest to give back, see balloon_update_target().
+	struct channel *chan;	// shared memory channel to another guest, NULL if none. see chan_attach().
+	int chan_role;		// CHAN_PRODUCER or CHAN_CONSUMER.
+	struct blk_dev *blk;	// disk, NULL if none. see blk_open().
+	struct vm_snapshot *snap;	// state to go back to on vm_reset(), NULL if none.
+	uint64_t io_exits_base;	// stats.io_exits at last reset, guest sees exits of its own run only.
+	uint64_t metrics_gpa;	// guest's struct metrics_page, 0 if none. see handle_metrics_register().
+	int irqchip;		// KVM emulates PIC/IOAPIC/LAPIC, see vm_irqchip_init().
+	uint32_t tsc_khz;	// guest TSC frequency, reported on TIMER_INFO when irqchip is set.
+	uint64_t xcr0;		// XCR0 of guest, 0 if it has no XSAVE. see vcpu_set_cpuid().
+	struct dedup_vm *dedup;	// page hashes for host dedup, NULL if VM is not scanned. see dedup_attach().
+	struct vm_io io;
+	struct lazy_image *lazy;	// guest image is loaded on demand, NULL if it was copied. see lazy_start().
+	struct vm_stats stats;
+};
+
+uint64_t now_ns() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+//////////////////////////////////////// Guest RAM placement ////////////////////////////////////////
+// by default guest RAM is faulted in by the vcpu on first touch, on whatever NUMA node the kernel likes. -N node binds RAM to a
+// node (and runs vcpu threads on the cpus of that node) and -P prefaults it before the guest starts: -P 1 with MAP_POPULATE,
+// -P N with N threads populating slices of RAM in parallel (for large guests one thread can not fault pages fast enough).
+// prefaulting is done once per VM: with -n, vm_reset() drops the pages a run touched, so later runs fault them in again.
+int prefault_threads;
+int numa_node = -1;
+long dedup_ms = -1;	// -K, guest RAM is deduplicated by host instead of KSM. see Host dedup.
+cpu_set_t vcpu_cpus;	// cpus vcpu threads may run on, set by placement_init().
+
+struct prefault_slice {
+	char *start;
+	size_t len;
 };
 
-void vm_init(struct vm *vm, size_t mem_size)
+void *prefault_worker(void *arg) {
+	struct prefault_slice *slice = arg;
+	if (madvise(slice->start, slice->len, MADV_POPULATE_WRITE) == 0) return NULL;
+	for (size_t off = 0; off < slice->len; off += PAGE_SIZE) // write fault so a real page is allocated, not the zero page.
+		((volatile char *)slice->start)[off] = 0;
+	return NULL;
+}
+
+void prefault_guest_ram(char *mem, size_t size, int threads) {
+	pthread_t tid[threads];
+	struct prefault_slice slice[threads];
+	size_t per = (size / threads + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+
+	for (int i = 0; i < threads; i++) {
+		slice[i].start = mem + i * per;
+		slice[i].len = (size_t)i * per >= size ? 0 : (size - i * per < per ? size - i * per : per);
+		if (pthread_create(&tid[i], NULL, prefault_worker, &slice[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < threads; i++)
+		pthread_join(tid[i], NULL);
+}
+
+void bind_guest_ram(char *mem, size_t size, int node) {
+	unsigned long nodemask[1024 / (8 * sizeof(unsigned long))] = { 0 };
+
+	nodemask[node / (8 * sizeof(unsigned long))] |= 1ul << (node % (8 * sizeof(unsigned long)));
+	if (syscall(SYS_mbind, mem, size, MPOL_BIND, nodemask, 1024, 0) < 0) {
+		perror("mbind");
+		exit(1);
+	}
+}
+
+void placement_init() { // cpus of numa_node (or all cpus) for vcpu threads.
+	char path[64], list[4096];
+	FILE *fp;
+
+	CPU_ZERO(&vcpu_cpus);
+	if (numa_node < 0) {
+		sched_getaffinity(0, sizeof(vcpu_cpus), &vcpu_cpus);
+		return;
+	}
+	snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", numa_node);
+	fp = fopen(path, "r");
+	if (fp == NULL || fgets(list, sizeof(list), fp) == NULL) {
+		perror(path);
+		exit(1);
+	}
+	fclose(fp);
+	for (char *p = strtok(list, ",\n"); p != NULL; p = strtok(NULL, ",\n")) { // "0-3,8-11"
+		int lo, hi;
+		int n = sscanf(p, "%d-%d", &lo, &hi);
+		if (n < 1) continue;
+		if (n == 1) hi = lo;
+		for (int cpu = lo; cpu <= hi && cpu < CPU_SETSIZE; cpu++)
+			CPU_SET(cpu, &vcpu_cpus);
+	}
+	if (CPU_COUNT(&vcpu_cpus) == 0) {
+		fprintf(stderr, "numa node %d has no cpus\n", numa_node);
+		exit(1);
+	}
+}
+
+void pin_vcpu_thread(int index) { // pin calling thread to index-th cpu of vcpu_cpus (wraps around).
+	cpu_set_t cpus;
+	int n = index % CPU_COUNT(&vcpu_cpus);
+
+	CPU_ZERO(&cpus);
+	for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+		if (CPU_ISSET(cpu, &vcpu_cpus) && n-- == 0) {
+			CPU_SET(cpu, &cpus);
+			break;
+		}
+	}
+	pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+int kvm_open()	// /dev/kvm is opened once and shared by all VMs of this process.
 {
-	int api_ver;
-	struct kvm_userspace_memory_region memreg; // it is virtual memory region of host which will be used by guest as RAM(Physical memory of guest).
+	int sys_fd, api_ver;
 
-	vm->sys_fd = open("/dev/kvm", O_RDWR); // kvm is file data will be read/written here. kvm is system for guest program.
-	if (vm->sys_fd < 0) {
+	sys_fd = open("/dev/kvm", O_RDWR); // kvm is file data will be read/written here. kvm is system for guest program.
+	if (sys_fd < 0) {
 		perror("open /dev/kvm");
 		exit(1);
 	}
 
-	api_ver = ioctl(vm->sys_fd, KVM_GET_API_VERSION, 0); // reading the API version of KVM.
+	api_ver = ioctl(sys_fd, KVM_GET_API_VERSION, 0); // reading the API version of KVM.
 	if (api_ver < 0) {
 		perror("KVM_GET_API_VERSION");
 		exit(1);
@@ -98,6 +326,16 @@ void vm_init(struct vm *vm, size_t mem_size)
 
 	// comment this
 	// printf("Printing KVM API version: %d, %d\n", api_ver, KVM_API_VERSION);
+	return sys_fd;
+}
+
+void vm_init(struct vm *vm, int sys_fd, size_t mem_size)
+{
+	struct kvm_userspace_memory_region memreg; // it is virtual memory region of host which will be used by guest as RAM(Physical memory of guest).
+
+	memset(vm, 0, sizeof(*vm));
+	vm->sys_fd = sys_fd;
+	vm->mem_size = mem_size;
 
 	vm->fd = ioctl(vm->sys_fd, KVM_CREATE_VM, 0); // VM is created and fd is returned.
 	if (vm->fd < 0) {
@@ -115,20 +353,28 @@ void vm_init(struct vm *vm, size_t mem_size)
 	// (It is not actual PA it will convert to VA of hypervisor then PA of hypervisor which is actual address of RAM).
 	// NULL is the hint which is minimum virtual address to allocate if memory mapping already exists then kernel will allocate anywhere after this hint. since NULL is used it will allocate at any virtual address.
 	// rest of parameters are for protection of allocated memory etc.
+	// with -P 1 kernel populates the pages in mmap itself, but if RAM has to be bound to a node pages must be populated after mbind.
 	vm->mem = mmap(NULL, mem_size, PROT_READ | PROT_WRITE,
-		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);	
+		   MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | (prefault_threads == 1 && numa_node < 0 ? MAP_POPULATE : 0), -1, 0);
 	if (vm->mem == MAP_FAILED) {
 		perror("mmap mem");
 		exit(1);
 	}
-	printf("Guest memory(RAM) allocated: %ld MB, at host virtual address from: %p,  to: %p\n", mem_size/(1024*1024), vm->mem, vm->mem+mem_size); // mmap do continuous allocation hence you can add to get last virtual address.
+	if (numa_node >= 0) bind_guest_ram(vm->mem, mem_size, numa_node);
+	if (prefault_threads > 1 || (prefault_threads == 1 && numa_node >= 0)) {
+		uint64_t t = now_ns();
+		prefault_guest_ram(vm->mem, mem_size, prefault_threads);
+		printf("Guest memory prefaulted by %d threads in %lu us\n", prefault_threads, (now_ns() - t) / 1000);
+	}
+	debug_printf("Guest memory(RAM) allocated: %ld MB, at host virtual address from: %p,  to: %p\n", mem_size/(1024*1024), vm->mem, vm->mem+mem_size); // mmap do continuous allocation hence you can add to get last virtual address.
 
 	// kernel should be configured with CONFIG_KSM to use madvice otherwise error is thrown at this line.
-	madvise(vm->mem, mem_size, MADV_MERGEABLE);// telling kernel that pages in this range of memory are mergeable means if any page in this memory range has same content as any (same/other processes mergeable) page then merge the pages means leave only one copy of page and if any process want to modify then create the separate copy so that it will unmerged.
+	// with -K host does dedup itself (KSM merges only anonymous pages, host dedup makes them file pages).
+	if (dedup_ms < 0) madvise(vm->mem, mem_size, MADV_MERGEABLE);// telling kernel that pages in this range of memory are mergeable means if any page in this memory range has same content as any (same/other processes mergeable) page then merge the pages means leave only one copy of page and if any process want to modify then create the separate copy so that it will unmerged.
 	// any two pages will be merged only if both are marked as mergeable.
 
 	memreg.slot = 0;
-	memreg.flags = 0;
+	memreg.flags = dedup_ms >= 0 ? KVM_MEM_LOG_DIRTY_PAGES : 0; // dedup rehashes only pages guest wrote.
 	memreg.guest_phys_addr = 0; // physical address starts from 0 (guest should think that his RAM starts from address 0 you can set it to other value if you want) so in guest's page table physical address will be used from 0.
 	memreg.memory_size = mem_size; // setting the memory size.
 	memreg.userspace_addr = (unsigned long)vm->mem; // this is used by host only guest don't know about it. it is actually virtual address of host where guest is allocated.
@@ -138,9 +384,129 @@ void vm_init(struct vm *vm, size_t mem_size)
 	}
 }
 
+//////////////////////////////////////// In-kernel irqchip ////////////////////////////////////////
+// -I gives guests (but the real mode one) in-kernel PIC, IOAPIC and LAPIC. guest uses LAPIC as x2APIC (MSRs, nothing to map) with
+// the TSC deadline timer and handlers in the IDT loaded by setup_long_mode(), so it can sleep in HLT till its deadline. KVM handles
+// that HLT and the timer interrupt itself, vcpu thread sleeps in kernel and host sees no exit. for the same reason HLT of a guest
+// which is done never reaches host either, so guest tells it with OUT on HALT_PORT. IN on TIMER_INFO gives guest TSC frequency.
+// PIT (KVM_CREATE_PIT2) is not created, guest has the LAPIC timer and a PIT would only add a kernel thread per VM.
+int use_irqchip;
+
+#define MSR_IA32_APICBASE 0x1b
+#define MSR_IA32_TSC_DEADLINE 0x6e0
+#define CPUID_1_ECX_X2APIC (1U << 21)
+#define CPUID_1_ECX_TSC_DEADLINE (1U << 24)
+
+void vm_irqchip_init(struct vm *vm) { // before vcpu_init().
+	if (ioctl(vm->fd, KVM_CREATE_IRQCHIP, 0) < 0) {
+		perror("KVM_CREATE_IRQCHIP, guest runs without interrupts");
+		return;
+	}
+	vm->irqchip = 1;
+}
+
+uint64_t vcpu_get_msr(int vcpu_fd, uint32_t index) {
+	struct {
+		struct kvm_msrs hdr;
+		struct kvm_msr_entry entry;
+	} msrs = { .hdr.nmsrs = 1, .entry.index = index };
+
+	if (ioctl(vcpu_fd, KVM_GET_MSRS, &msrs) != 1) {
+		perror("KVM_GET_MSRS");
+		exit(1);
+	}
+	return msrs.entry.data;
+}
+
+void vcpu_set_msr(int vcpu_fd, uint32_t index, uint64_t data) {
+	struct {
+		struct kvm_msrs hdr;
+		struct kvm_msr_entry entry;
+	} msrs = { .hdr.nmsrs = 1, .entry.index = index, .entry.data = data };
+
+	if (ioctl(vcpu_fd, KVM_SET_MSRS, &msrs) != 1) {
+		perror("KVM_SET_MSRS");
+		exit(1);
+	}
+}
+
+//////////////////////////////////////// CPUID and SIMD state ////////////////////////////////////////
+// without KVM_SET_CPUID2 guest sees an almost empty CPUID and no XSAVE, and with CR4 left at the paging bits any SSE instruction
+// is #UD. every vcpu gets what KVM supports on this host (AVX2, AVX-512 included), XCR0 with the SIMD state components of it, and
+// CR4.OSFXSR/OSXMMEXCPT/OSXSAVE from vcpu_simd_cr4() in the protected and long mode loaders, so guest code can use vector
+// instructions from its first one. AMX is left out of XCR0, its state does not fit in struct kvm_xsave of snapshots. x2APIC and
+// TSC deadline timer are added with irqchip, KVM emulates both but leaves TSC deadline out of its supported CPUID.
+#define CPUID_1_ECX_XSAVE (1U << 26)
+#define XCR0_SIMD 0xe7ull	// x87, SSE, AVX, AVX-512 opmask, ZMM_Hi256 and Hi16_ZMM.
+
+void vcpu_set_cpuid(struct vm *vm, int vcpu_fd) {
+	int nent = 256;
+	struct kvm_cpuid2 *cpuid = calloc(1, sizeof(struct kvm_cpuid2) + nent * sizeof(struct kvm_cpuid_entry2));
+	int xsave = 0;
+
+	cpuid->nent = nent;
+	if (ioctl(vm->sys_fd, KVM_GET_SUPPORTED_CPUID, cpuid) < 0) {
+		perror("KVM_GET_SUPPORTED_CPUID");
+		exit(1);
+	}
+	vm->xcr0 = 0;
+	for (uint32_t i = 0; i < cpuid->nent; i++) {
+		struct kvm_cpuid_entry2 *e = &cpuid->entries[i];
+		if (e->function == 1) {
+			xsave = (e->ecx & CPUID_1_ECX_XSAVE) != 0;
+			if (!vm->irqchip) continue;
+			e->ecx |= CPUID_1_ECX_X2APIC;
+			if (ioctl(vm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_TSC_DEADLINE_TIMER) > 0)
+				e->ecx |= CPUID_1_ECX_TSC_DEADLINE;
+		} else if (e->function == 0xd && e->index == 0) { // state components XCR0 can have.
+			vm->xcr0 = ((uint64_t)e->edx << 32 | e->eax) & XCR0_SIMD;
+		}
+	}
+	if (!xsave || ioctl(vm->sys_fd, KVM_CHECK_EXTENSION, KVM_CAP_XCRS) <= 0) vm->xcr0 = 0;
+	if (ioctl(vcpu_fd, KVM_SET_CPUID2, cpuid) < 0) {
+		perror("KVM_SET_CPUID2");
+		exit(1);
+	}
+	free(cpuid);
+}
+
+void vcpu_set_xcr0(struct vm *vm, int vcpu_fd) { // after vcpu_set_cpuid(), KVM checks XCR0 against guest CPUID.
+	struct kvm_xcrs xcrs = { .nr_xcrs = 1, .xcrs[0] = { .xcr = 0, .value = vm->xcr0 } };
+
+	if (vm->xcr0 == 0) return;
+	if (ioctl(vcpu_fd, KVM_SET_XCRS, &xcrs) < 0) {
+		perror("KVM_SET_XCRS");
+		exit(1);
+	}
+}
+
+uint64_t vcpu_simd_cr4(struct vm *vm) {
+	return CR4_OSFXSR | CR4_OSXMMEXCPT | (vm->xcr0 ? CR4_OSXSAVE : 0);
+}
+
+#define GTLB_SIZE 64	// entries in software TLB of guest translations, direct mapped on page number.
+
+struct gtlb_entry {
+	uint64_t vpn;	// guest virtual page number + 1, 0 means entry is empty.
+	uint64_t gpa;	// guest physical address of that page.
+};
+
+struct guest_mmu {	// what host needs to know to walk guest page tables.
+	uint64_t cr0, cr3, cr4, efer;
+	uint64_t hits, misses, flushes;
+	struct gtlb_entry tlb[GTLB_SIZE];
+};
+
 struct vcpu {
 	int fd;
 	struct kvm_run *kvm_run;
+	int sync_sregs;		// KVM can copy sregs into kvm_run->s.regs on exit (KVM_CAP_SYNC_REGS).
+	int sregs_idle;		// exits since the last one which needed sregs.
+	struct guest_mmu mmu;
+	int started;		// run loop was entered once, later entries resume the guest after preemption.
+	uint64_t start_ns;
+	int io_pending;		// exit in kvm_run was put off by io_throttle(), chan_wait() or blk_wait(), it is handled before KVM_RUN.
+	uint64_t wait_deadline;	// CHAN_WAIT/BLK_WAIT in kvm_run returns 0 at this time if eventfd is not signalled, 0 if guest is not waiting.
 };
 
 void vcpu_init(struct vm *vm, struct vcpu *vcpu)
@@ -152,6 +518,16 @@ void vcpu_init(struct vm *vm, struct vcpu *vcpu)
 		perror("KVM_CREATE_VCPU");
                 exit(1);
 	}
+	if (vm->irqchip) {
+		int khz = ioctl(vcpu->fd, KVM_GET_TSC_KHZ, 0);
+		if (khz <= 0) {
+			perror("KVM_GET_TSC_KHZ");
+			exit(1);
+		}
+		vm->tsc_khz = khz;
+	}
+	vcpu_set_cpuid(vm, vcpu->fd);
+	vcpu_set_xcr0(vm, vcpu->fd);
 
 	vcpu_mmap_size = ioctl(vm->sys_fd, KVM_GET_VCPU_MMAP_SIZE, 0); // getting the size of vcpu, vcpu size includes registers size etc. this memory is shared with KVM. (I think when context switch will happen then vcpu use this space to store the registers)
         if (vcpu_mmap_size <= 0) {
@@ -166,80 +542,378 @@ void vcpu_init(struct vm *vm, struct vcpu *vcpu)
 		exit(1);
 	}
 	// comment this
-	printf("VCPU size allocated: %d KB, at virtual address of hypervisor(host): %p\n", vcpu_mmap_size/1024, vcpu->kvm_run);
+	debug_printf("VCPU size allocated: %d KB, at virtual address of hypervisor(host): %p\n", vcpu_mmap_size/1024, vcpu->kvm_run);
+
+	// host has to translate guest pointers on hypercalls and for that it needs CR3 etc. KVM is asked to put sregs in kvm_run only
+	// while hypercalls come (see guest_mmu_sync()), console output and other exits without pointers do not pay for the copy.
+	memset(&vcpu->mmu, 0, sizeof(vcpu->mmu));
+	vcpu->started = 0;
+	vcpu->io_pending = 0;
+	vcpu->wait_deadline = 0;
+	vcpu->sync_sregs = ioctl(vm->fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS) > 0
+		&& (ioctl(vm->fd, KVM_CHECK_EXTENSION, KVM_CAP_SYNC_REGS) & KVM_SYNC_X86_SREGS);
+	vcpu->sregs_idle = 0;
+	vcpu->kvm_run->kvm_valid_regs = 0;
+}
+
+
+
+
+//////////////////////////////////////// Host file handle pool ////////////////////////////////////////
+// guests open and close the same few files again and again, every FS_OPEN was an open() (path walk, permission checks) and every
+// FS_CLOSE a close(). host fds are kept in a pool keyed by (path, access mode + O_APPEND) which outlives guest's close: FS_OPEN of a
+// pooled file takes its fd (O_TRUNC is done with ftruncate), FS_CLOSE only gives it back. every guest fd has its own offset and
+// reads/writes are pread/pwrite at it, so guest fds (of one or many VMs) can share a host fd. pooled files nobody uses are closed
+// least recently used first when there are more than fd_pool_size of them. a file renamed, unlinked or chmod'ed on host (inotify,
+// IN_ATTRIB comes with link count changes) is dropped from the pool, guest fds which have it keep it like after a real open().
+// the key is realpath() of guest's path, so "x", "./x" and "a/../x" share an entry and a retargeted symlink opens its new target.
+struct fd_pool_entry {
+	char path[MAX_PATHNAME];	// resolved, the watch is on it too.
+	int flags;		// O_ACCMODE and O_APPEND of the fd.
+	int fd;
+	int wd;			// inotify watch of the file.
+	int refs;		// guest fds using it.
+	int stale;		// file changed on host, closed when refs gets 0.
+	struct fd_pool_entry *prev, *next;	// pool list, most recently used first.
+};
+
+int fd_pool_size = 64;	// -H, unused fds kept open. 0 = no pool.
+pthread_mutex_t fd_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+struct fd_pool_entry *fd_pool;	// head of list.
+int fd_pool_len;		// entries in list, not stale ones.
+int fd_pool_inotify = -1;
+uint64_t fd_pool_hits, fd_pool_misses, fd_pool_evictions, fd_pool_invalidations;
+
+void fd_pool_unlink(struct fd_pool_entry *e) {
+	if (e->prev != NULL) e->prev->next = e->next;
+	else fd_pool = e->next;
+	if (e->next != NULL) e->next->prev = e->prev;
+	e->prev = e->next = NULL;
+	fd_pool_len--;
+}
+
+void fd_pool_free(struct fd_pool_entry *e) { // entry is not in list.
+	int shared_wd = 0;
+	for (struct fd_pool_entry *p = fd_pool; p != NULL; p = p->next)
+		shared_wd |= p->wd == e->wd; // same inode with other flags, watch is per inode.
+	if (e->wd >= 0 && !shared_wd) inotify_rm_watch(fd_pool_inotify, e->wd);
+	close(e->fd);
+	free(e);
+}
+
+void fd_pool_invalidate() { // drops files which changed on host, call with lock held.
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t n;
+
+	while ((n = read(fd_pool_inotify, buf, sizeof(buf))) > 0) {
+		for (char *p = buf; p < buf + n; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+			int wd = ((struct inotify_event *)p)->wd;
+			for (struct fd_pool_entry *e = fd_pool, *next; e != NULL; e = next) {
+				next = e->next;
+				if (e->wd != wd) continue;
+				fd_pool_unlink(e);
+				fd_pool_invalidations++;
+				e->stale = 1;
+				if (e->refs == 0) fd_pool_free(e);
+				else e->wd = -1; // watch is gone with the inode or removed by the next free.
+			}
+		}
+	}
 }
 
+// host fd for guest's open(), *pe is set to its pool entry (NULL if it is not pooled). -1 with errno on error.
+int fd_pool_get(const char *path, int flags, int mode, struct fd_pool_entry **pe) {
+	int key = flags & (O_ACCMODE | O_APPEND);
+	struct fd_pool_entry *e = NULL;
+	char real[PATH_MAX];
+	int resolved;
 
+	*pe = NULL;
+	if (fd_pool_size == 0) return open(path, flags | O_CLOEXEC, mode);
+	resolved = realpath(path, real) != NULL; // fails for files O_CREAT makes, they can not be pooled yet.
+	pthread_mutex_lock(&fd_pool_lock);
+	if (fd_pool_inotify < 0) fd_pool_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	fd_pool_invalidate();
+	for (e = resolved ? fd_pool : NULL; e != NULL; e = e->next)
+		if (e->flags == key && strcmp(e->path, real) == 0) break;
+	if (e != NULL && (flags & (O_CREAT | O_EXCL)) == (O_CREAT | O_EXCL)) {
+		pthread_mutex_unlock(&fd_pool_lock);
+		errno = EEXIST;
+		return -1;
+	}
+	if (e != NULL) {
+		if ((flags & O_TRUNC) && ftruncate(e->fd, 0) < 0) {
+			pthread_mutex_unlock(&fd_pool_lock);
+			return -1;
+		}
+		fd_pool_unlink(e);
+		fd_pool_hits++;
+	} else {
+		int fd = open(path, flags | O_CLOEXEC, mode);
+		if (fd >= 0 && !resolved) resolved = realpath(path, real) != NULL;
+		if (fd < 0 || !resolved || strlen(real) >= MAX_PATHNAME) {
+			pthread_mutex_unlock(&fd_pool_lock);
+			return fd;
+		}
+		e = calloc(1, sizeof(struct fd_pool_entry));
+		strcpy(e->path, real);
+		e->flags = key;
+		e->fd = fd;
+		e->wd = inotify_add_watch(fd_pool_inotify, real, IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+		fd_pool_misses++;
+	}
+	e->next = fd_pool; // to the front.
+	if (fd_pool != NULL) fd_pool->prev = e;
+	fd_pool = e;
+	fd_pool_len++;
+	e->refs++;
+	struct fd_pool_entry *p = fd_pool, *prev;
+	while (p->next != NULL) p = p->next;
+	for (; p != NULL && fd_pool_len > fd_pool_size; p = prev) { // evict unused ones from the back.
+		prev = p->prev;
+		if (p->refs > 0) continue;
+		fd_pool_unlink(p);
+		fd_pool_free(p);
+		fd_pool_evictions++;
+	}
+	*pe = e;
+	pthread_mutex_unlock(&fd_pool_lock);
+	return e->fd;
+}
+
+void fd_pool_put(struct fd_pool_entry *e, int fd) { // guest closed it.
+	if (e == NULL) {
+		close(fd);
+		return;
+	}
+	pthread_mutex_lock(&fd_pool_lock);
+	if (--e->refs == 0 && e->stale) fd_pool_free(e);
+	pthread_mutex_unlock(&fd_pool_lock);
+}
 
+void print_fd_pool_stats() {
+	if (fd_pool_hits + fd_pool_misses == 0) return;
+	printf("Host: file handle pool %lu hits %lu misses, %lu evicted %lu invalidated\n", fd_pool_hits, fd_pool_misses,
+	       fd_pool_evictions, fd_pool_invalidations);
+}
 
 /////////////////////////////////////////////  My CODE ////////////////////////////////////////////////////////////////////////////////////////
 extern int errno;
-int file_table_len;
-size_t vm_size = 0x200000;
+size_t vm_size = 0x200000; // RAM of every guest.
 
 struct open_file_entry {
 	int guest_fd;
 	int fd;
 	char pathname[MAX_PATHNAME];
+	struct fd_pool_entry *pool;	// NULL if fd is not pooled.
+	int64_t offset;			// file offset of this guest fd, host fd may be shared.
 	struct open_file_entry *next;
-} *file;
+};
 
-struct open_file_entry* new_file_entry() {
+struct open_file_entry* new_file_entry(struct vm *vm) {
 	struct open_file_entry *ptr = malloc(sizeof(struct open_file_entry));
-	ptr->guest_fd = file_table_len;
+	ptr->guest_fd = vm->file_table_len;
 	ptr->fd = -1;
 	ptr->next = NULL;
-	file_table_len += 1;
+	vm->file_table_len += 1;
 	return ptr;
 }
 
-struct open_file_entry* make_entry() { // return the lowest unused fd.
-	struct open_file_entry *ptr = file;
+struct open_file_entry* make_entry(struct vm *vm) { // return the lowest unused fd.
+	struct open_file_entry *ptr = vm->file;
 	if(ptr->fd == -1) return ptr;
 	while(ptr->next != NULL) {
 		if(ptr->next->fd == -1) return ptr->next;
 		ptr = ptr->next;
 	}
-	ptr->next = new_file_entry();
+	ptr->next = new_file_entry(vm);
 	return ptr->next;
 }
 
-int is_valid_fd(int guest_fd) { // validate the fd from open file table.
-	struct open_file_entry *ptr = file;
-	do {
+int is_valid_fd(struct vm *vm, int guest_fd) { // validate the fd from open file table.
+	struct open_file_entry *ptr = vm->file;
+	while(ptr != NULL && ptr->guest_fd <= guest_fd) { // entries are in increasing guest_fd order.
 		if(ptr->guest_fd == guest_fd && ptr->fd != -1) return TRUE;
-	} while(ptr->next != NULL && guest_fd < ptr->guest_fd);
+		ptr = ptr->next;
+	}
 	return FALSE;
 }
 
-struct open_file_entry* get_entry(int guest_fd) {
-	struct open_file_entry *ptr = file;
-	do {
+struct open_file_entry* get_entry(struct vm *vm, int guest_fd) {
+	struct open_file_entry *ptr = vm->file;
+	while(ptr != NULL && ptr->guest_fd <= guest_fd) {
 		if(ptr->guest_fd == guest_fd && ptr->fd != -1) return ptr;
-	} while(ptr->next != NULL && guest_fd < ptr->guest_fd);
+		ptr = ptr->next;
+	}
 	return NULL;
 }
 
-void fs_init() {
-	file_table_len = 0;
-	file = new_file_entry();
+void fs_init(struct vm *vm) {
+	vm->file_table_len = 0;
+	vm->file = new_file_entry(vm);
+}
+
+void fs_release(struct vm *vm) { // close host files guest left open and free the table.
+	struct open_file_entry *ptr = vm->file;
+	while(ptr != NULL) {
+		struct open_file_entry *next = ptr->next;
+		if(ptr->fd != -1) fd_pool_put(ptr->pool, ptr->fd);
+		free(ptr);
+		ptr = next;
+	}
+	vm->file = NULL;
+	vm->file_table_len = 0;
 }
 
-int validate_guest_addr(void *vm_mem, void *ptr, int offset) {
+int validate_guest_addr(struct vm *vm, void *ptr, long offset) {
 	char *p = (char *)ptr;
-	if(p < (char *)vm_mem || p + offset > (char *)vm_mem + vm_size) {
+	if(p < vm->mem || offset < 0 || p + offset > vm->mem + vm->mem_size) {
 		return FALSE;
 	}
 	return TRUE;
 }
 
+//////////////////////////////////////// Guest address translation ////////////////////////////////////////
+// guest passes its virtual addresses(GVA) in hypercalls. host walks guest page tables (CR3 from sregs) to get guest physical address(GPA)
+// which is offset from vm->mem. translations are cached in a small software TLB which is flushed when CR3 or paging mode changes,
+// so guest should reload CR3 after changing page table entries of hypercall buffers (same as it does for real TLB).
+#define GPA_INVALID ((uint64_t)-1)
+#define PTE64_ADDR 0x000ffffffffff000ull
+
+char *guest_phys(struct vm *vm, uint64_t gpa, uint64_t len) { // host pointer of guest physical range, NULL if outside guest RAM.
+	if(gpa >= vm->mem_size || len > vm->mem_size - gpa) return NULL;
+	return vm->mem + gpa;
+}
+
+#define SREGS_IDLE_EXITS 16	// exits without a hypercall after which KVM stops syncing sregs into kvm_run.
+
+// sregs are fetched only on exits which translate. the first one of a burst does KVM_GET_SREGS and turns on KVM_SYNC_X86_SREGS,
+// so the next hypercalls find sregs in kvm_run. guest_mmu_exit() turns it off when SREGS_IDLE_EXITS exits did not need them.
+void guest_mmu_sync(struct vcpu *vcpu) { // call once per exit before translating.
+	struct guest_mmu *mmu = &vcpu->mmu;
+	struct kvm_sregs sregs, *sr = &sregs;
+
+	vcpu->sregs_idle = 0;
+	if(vcpu->kvm_run->kvm_valid_regs & KVM_SYNC_X86_SREGS) {
+		sr = &vcpu->kvm_run->s.regs.sregs;
+	} else if(ioctl(vcpu->fd, KVM_GET_SREGS, &sregs) < 0) {
+		perror("KVM_GET_SREGS");
+		exit(1);
+	} else if(vcpu->sync_sregs) {
+		vcpu->kvm_run->kvm_valid_regs = KVM_SYNC_X86_SREGS;
+	}
+	if(sr->cr3 != mmu->cr3 || ((sr->cr0 ^ mmu->cr0) & CR0_PG) || ((sr->cr4 ^ mmu->cr4) & (CR4_PAE | CR4_PSE))
+	   || ((sr->efer ^ mmu->efer) & EFER_LMA)) {
+		memset(mmu->tlb, 0, sizeof(mmu->tlb));
+		mmu->flushes++;
+		mmu->cr0 = sr->cr0;
+		mmu->cr3 = sr->cr3;
+		mmu->cr4 = sr->cr4;
+		mmu->efer = sr->efer;
+	}
+}
+
+static inline void guest_mmu_exit(struct vcpu *vcpu) { // call on every exit.
+	if(vcpu->kvm_run->kvm_valid_regs && ++vcpu->sregs_idle > SREGS_IDLE_EXITS) vcpu->kvm_run->kvm_valid_regs = 0;
+}
+
+uint64_t guest_walk(struct vm *vm, struct guest_mmu *mmu, uint64_t gva) { // page table walk, returns GPA or GPA_INVALID.
+	uint64_t table;
+	int level;
+
+	if(!(mmu->cr0 & CR0_PG)) return gva & 0xffffffff; // no paging (real/protected mode) and segment bases are 0 so GVA = GPA.
+
+	if(mmu->efer & EFER_LMA) { // 4 level: PML4 -> PDPT -> PD -> PT.
+		table = mmu->cr3 & PTE64_ADDR;
+		level = 3;
+	} else if(mmu->cr4 & CR4_PAE) { // 3 level: 4 entry PDPT -> PD -> PT.
+		uint64_t *pdpte = (uint64_t *)guest_phys(vm, (mmu->cr3 & 0xffffffe0) + ((gva >> 30) & 3) * 8, 8);
+		if(pdpte == NULL || !(*pdpte & PDE64_PRESENT)) return GPA_INVALID;
+		table = *pdpte & PTE64_ADDR;
+		level = 1;
+	} else { // 2 level 32 bit: PD -> PT, PD entry can map 4MB page if PSE.
+		uint32_t *pde = (uint32_t *)guest_phys(vm, (mmu->cr3 & 0xfffff000) + ((gva >> 22) & 0x3ff) * 4, 4);
+		if(pde == NULL || !(*pde & PDE32_PRESENT)) return GPA_INVALID;
+		if((mmu->cr4 & CR4_PSE) && (*pde & PDE32_PS)) return (*pde & 0xffc00000) | (gva & 0x3fffff);
+		uint32_t *pte = (uint32_t *)guest_phys(vm, (*pde & 0xfffff000) + ((gva >> 12) & 0x3ff) * 4, 4);
+		if(pte == NULL || !(*pte & PDE32_PRESENT)) return GPA_INVALID;
+		return (*pte & 0xfffff000) | (gva & 0xfff);
+	}
+
+	for(; level >= 0; level--) { // level 2 is PDPT (1GB page), level 1 is PD (2MB page), level 0 is PT (4KB page).
+		int shift = PAGE_SHIFT + 9 * level;
+		uint64_t *pte = (uint64_t *)guest_phys(vm, table + ((gva >> shift) & 0x1ff) * 8, 8);
+		if(pte == NULL || !(*pte & PDE64_PRESENT)) return GPA_INVALID;
+		if(level == 0 || (level <= 2 && (*pte & PDE64_PS))) {
+			uint64_t mask = (1ull << shift) - 1;
+			return (*pte & PTE64_ADDR & ~mask) | (gva & mask);
+		}
+		table = *pte & PTE64_ADDR;
+	}
+	return GPA_INVALID;
+}
+
+uint64_t guest_translate(struct vm *vm, struct guest_mmu *mmu, uint64_t gva) {
+	uint64_t vpn = gva >> PAGE_SHIFT;
+	struct gtlb_entry *e = &mmu->tlb[vpn % GTLB_SIZE];
+
+	if(e->vpn == vpn + 1) {
+		mmu->hits++;
+		return e->gpa | (gva & (PAGE_SIZE - 1));
+	}
+	mmu->misses++;
+	uint64_t gpa = guest_walk(vm, mmu, gva & ~(PAGE_SIZE - 1));
+	if(gpa == GPA_INVALID) return GPA_INVALID;
+	e->vpn = vpn + 1;
+	e->gpa = gpa;
+	return gpa | (gva & (PAGE_SIZE - 1));
+}
+
+// host pointer to len bytes at guest virtual address gva. NULL if any page is not mapped, outside guest RAM,
+// or the pages are not physically contiguous(host pointer could not cover them).
+char *guest_span(struct vm *vm, struct vcpu *vcpu, uint64_t gva, uint64_t len) {
+	if(len > vm->mem_size) return NULL;
+	uint64_t gpa = guest_translate(vm, &vcpu->mmu, gva);
+	if(gpa == GPA_INVALID) return NULL;
+	for(uint64_t next = (gva | (PAGE_SIZE - 1)) + 1; next - gva < len; next += PAGE_SIZE) {
+		if(guest_translate(vm, &vcpu->mmu, next) != gpa + (next - gva)) return NULL;
+	}
+	return guest_phys(vm, gpa, len);
+}
+
+// host pointer to null terminated string at gva, NULL if there is no '\0' in first max bytes.
+char *guest_string(struct vm *vm, struct vcpu *vcpu, uint64_t gva, uint64_t max) {
+	uint64_t gpa = guest_translate(vm, &vcpu->mmu, gva);
+	uint64_t len = 0;
+
+	if(gpa == GPA_INVALID) return NULL;
+	while(len < max) {
+		if(len > 0 && guest_translate(vm, &vcpu->mmu, gva + len) != gpa + len) return NULL;
+		uint64_t chunk = PAGE_SIZE - ((gva + len) & (PAGE_SIZE - 1)); // rest of this page.
+		if(chunk > max - len) chunk = max - len;
+		char *p = guest_phys(vm, gpa + len, chunk);
+		if(p == NULL) return NULL;
+		if(memchr(p, '\0', chunk) != NULL) return vm->mem + gpa;
+		len += chunk;
+	}
+	return NULL;
+}
+
+// host pointer to null terminated string at guest physical address gpa, NULL if there is no '\0' in first max bytes.
+char *guest_phys_string(struct vm *vm, uint64_t gpa, uint64_t max) {
+	char *p = guest_phys(vm, gpa, 1);
+	if(p == NULL) return NULL;
+	if(max > vm->mem_size - gpa) max = vm->mem_size - gpa;
+	return memchr(p, '\0', max) != NULL ? p : NULL;
+}
+
 void print_entry(struct open_file_entry *eptr) {
 	printf("Guest FD:%d,	Host FD:%d,	Pathname:%s\n", eptr->guest_fd, eptr->fd, eptr->pathname);
 }
 
-void print_file_table() {
+void print_file_table(struct vm *vm) {
 	printf("\n******************** Open File Table ***********************\n");
-	struct open_file_entry *ptr = file;
+	struct open_file_entry *ptr = vm->file;
 	while(ptr != NULL) {
 		if(ptr->fd != -1) print_entry(ptr);
 		ptr = ptr->next;
@@ -249,10 +923,10 @@ void print_file_table() {
 
 int get_open_flags(int gflags) {
 	int flags = 0;
+	if((gflags & (OPN_RDONLY|OPN_WRONLY|OPN_RDWR)) == 0) return -1; // O_RDONLY is 0 so check guest flags not host flags.
 	if(gflags & OPN_RDONLY) flags |= O_RDONLY;
 	if(gflags & OPN_WRONLY) flags |= O_WRONLY;
 	if(gflags & OPN_RDWR) 	flags |= O_RDWR;
-	if(flags == 0) return -1;
 
 	if(gflags & OPN_CREAT) 	flags |= O_CREAT;
 	if(gflags & OPN_TRUNC) 	flags |= O_TRUNC;
@@ -275,209 +949,2763 @@ int get_lseek_whence(int gflag) {
 	return -1;
 }
 
-int run_vm(struct vm *vm, struct vcpu *vcpu, size_t sz) {
-	struct kvm_regs regs;
-	uint64_t memval = 0;
-	uint32_t numExits = 0;
-	fs_init(); // initializing my file system.
+// copy len bytes between two host files without bouncing them through guest memory.
+// off_in/off_out of -1 means use the current file offset (like read/write do).
+// copy_file_range() lets the kernel do it (reflink/server side copy on some fs), if it is not supported for these files
+// (different fs on old kernels, pipes etc.) then splice() through a pipe is used, data still stays inside the kernel.
+ssize_t copy_host_file(int fd_in, loff_t off_in, int fd_out, loff_t off_out, size_t len) {
+	static __thread int pipe_fd[2] = {-1, -1}; // one pipe per vcpu thread.
+	loff_t oin = off_in, oout = off_out;
+	loff_t *pin = off_in < 0 ? NULL : &oin;
+	loff_t *pout = off_out < 0 ? NULL : &oout;
+	size_t done = 0;
+
+	while(done < len) {
+		ssize_t n = copy_file_range(fd_in, pin, fd_out, pout, len - done, 0);
+		// EBADF is also what an O_APPEND output gets, splice() can append.
+		if(n < 0 && done == 0 && (errno == EXDEV || errno == ENOSYS || errno == EOPNOTSUPP || errno == EINVAL || errno == EBADF))
+			break; // fall back to splice.
+		if(n < 0) return -1;
+		if(n == 0) return done; // EOF of input file.
+		done += n;
+	}
+	if(done == len) return done;
+
+	if(pipe_fd[0] == -1 && pipe(pipe_fd) < 0) return -1;
+	while(done < len) {
+		ssize_t n = splice(fd_in, pin, pipe_fd[1], NULL, len - done, SPLICE_F_MOVE);
+		if(n < 0) return -1;
+		if(n == 0) break;
+		ssize_t left = n;
+		while(left > 0) {
+			ssize_t m = splice(pipe_fd[0], NULL, fd_out, pout, left, SPLICE_F_MOVE);
+			if(m <= 0) { // pipe still holds data, the next copy on this thread would write it to its file. start with a new pipe.
+				int err = m == 0 ? EIO : errno;
+				close(pipe_fd[0]);
+				close(pipe_fd[1]);
+				pipe_fd[0] = pipe_fd[1] = -1;
+				errno = err;
+				return -1;
+			}
+			left -= m;
+		}
+		done += n;
+	}
+	return done;
+}
+
+//////////////////////////////////////// Record/Replay of exits ////////////////////////////////////////
+// record mode (-o file) logs every exit with its timestamps, port data, FS op arguments/result and the bytes host wrote into guest memory.
+// replay mode (-i file) runs the same guest but instead of handling exits against host FS/terminal it copies the recorded results
+// back into the guest. so guest sees exactly the same results and exit handling cost is constant(no host I/O noise).
+// replay checks every exit against its record: reason, port, OUT data and what a hypercall asks for (op, arguments, hash of
+// pathname/written data), a guest which does something else than it did when recorded stops with "replay diverged".
+#define TRACE_OFF 0
+#define TRACE_RECORD 1
+#define TRACE_REPLAY 2
+#define TRACE_MAGIC 0x5254564b	// "KVTR"
+#define TRACE_VERSION 3
+#define TRACE_MAX_PATCH 3	// file handler, op struct and data buffer.
+
+struct trace_file_header {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t mem_size;
+} __attribute__((packed));
+
+struct trace_exit {
+	uint64_t ts_ns;		// KVM_RUN returned at this time(from start of run).
+	uint32_t handle_ns;	// time host spent handling this exit.
+	uint16_t reason;
+	uint16_t port;
+	uint8_t direction;
+	uint8_t size;
+	uint8_t op;		// op of FS_PORT, HC_PORT and BALLOON_PORT request otherwise 0xff.
+	uint8_t npatch;		// number of trace_patch following this record.
+	uint32_t data;		// value written by OUT or value returned to IN.
+	int32_t args[3];	// request arguments (fd, size/count/offset, flags/whence, hash of pathname or written data).
+	int32_t result;		// FS op result.
+} __attribute__((packed));
+
+struct trace_patch {	// len bytes of guest memory at gpa follows this.
+	uint64_t gpa;		// guest RAM may be above 4 GB (-M).
+	uint32_t len;
+} __attribute__((packed));
+
+int trace_mode = TRACE_OFF;
+char *trace_path;
+FILE *trace_fp;
+struct trace_exit trace_cur;
+int trace_pending;		// trace_cur is not written yet.
+struct file_handler *trace_fh;	// FS request of current exit.
+void *trace_req;		// request struct of other hypercalls (BALLOON_PORT), recorded as it is.
+size_t trace_req_len;
+char *trace_buf;		// data buffer a hypercall filled in (HC_PORT FS_READ).
+long trace_buf_len;
+uint64_t trace_start_ns, trace_handle_total, trace_recorded_total;
+uint32_t trace_count;
+
+
+// an exit(1) while recording leaves the exit it happened on pending and the rest in stdio buffer, write them out so the
+// trace shows where it stopped. its patches are not known then, the record has none.
+void trace_flush() {
+	if(trace_fp == NULL || trace_mode != TRACE_RECORD) return;
+	if(trace_pending) {
+		trace_pending = 0;
+		trace_cur.npatch = 0;
+		fwrite(&trace_cur, sizeof(trace_cur), 1, trace_fp);
+	}
+	fflush(trace_fp);
+}
+
+void trace_open(size_t mem_size) {
+	struct trace_file_header hdr;
+	trace_fp = fopen(trace_path, trace_mode == TRACE_RECORD ? "wb" : "rb");
+	if(trace_fp == NULL) {
+		perror(trace_path);
+		exit(1);
+	}
+	if(trace_mode == TRACE_RECORD) {
+		hdr.magic = TRACE_MAGIC;
+		hdr.version = TRACE_VERSION;
+		hdr.mem_size = mem_size;
+		fwrite(&hdr, sizeof(hdr), 1, trace_fp);
+		static int flush_registered;
+		if(!flush_registered++) atexit(trace_flush);
+	} else if(fread(&hdr, sizeof(hdr), 1, trace_fp) != 1 || hdr.magic != TRACE_MAGIC
+		  || hdr.version != TRACE_VERSION || hdr.mem_size != mem_size) {
+		fprintf(stderr, "%s: not a trace of this guest\n", trace_path);
+		exit(1);
+	}
+	trace_pending = 0;
+	trace_count = 0;
+	trace_handle_total = trace_recorded_total = 0;
+	trace_start_ns = now_ns();
+}
+
+void trace_close() {
+	if(trace_fp == NULL) return;
+	if(trace_mode == TRACE_RECORD)
+		printf("Host: recorded %u exits to %s, host handling %lu us\n", trace_count, trace_path, trace_handle_total/1000);
+	else
+		printf("Host: replayed %u exits from %s, host handling %lu us (recorded %lu us)\n", trace_count, trace_path,
+		       trace_handle_total/1000, trace_recorded_total/1000);
+	fclose(trace_fp);
+	trace_fp = NULL;
+}
+
+uint32_t trace_hash(const char *p, size_t len) { // FNV-1a, 0 for memory guest does not have.
+	uint32_t h = 2166136261u;
+	if(p == NULL) return 0;
+	for(size_t i = 0; i < len; i++) h = (h ^ (uint8_t)p[i]) * 16777619u;
+	return h;
+}
+
+// what the request of this exit asks for, read before host handles it since results are written into the same structs.
+// fills in a[] and returns op of request, 0xff if port has none.
+int trace_request(struct vm *vm, struct vcpu *vcpu, uint16_t port, uint32_t val, int32_t *a) {
+	int op = 0xff;
+
+	if(port == STDOUT) {
+		guest_mmu_sync(vcpu);
+		char *str = guest_string(vm, vcpu, val, vm->mem_size);
+		a[0] = trace_hash(str, str == NULL ? 0 : strlen(str));
+	} else if(port == FS_PORT) {
+		guest_mmu_sync(vcpu);
+		struct file_handler *fh = (struct file_handler *)guest_span(vm, vcpu, val, sizeof(struct file_handler));
+		if(fh == NULL) return op;
+		op = fh->op;
+		a[0] = fh->fd;
+		switch(fh->op) {
+		case FS_OPEN: {
+			struct open_file *p = (struct open_file *)guest_span(vm, vcpu, (uintptr_t)fh->op_struct, sizeof(*p));
+			if(p == NULL) break;
+			char *path = guest_string(vm, vcpu, (uintptr_t)p->pathname, MAX_PATHNAME);
+			a[0] = p->flags;
+			a[1] = p->mode;
+			a[2] = trace_hash(path, path == NULL ? 0 : strlen(path));
+			break;
+		}
+		case FS_READ: {
+			struct read_file *p = (struct read_file *)guest_span(vm, vcpu, (uintptr_t)fh->op_struct, sizeof(*p));
+			if(p == NULL) break;
+			a[0] = p->fd;
+			a[1] = p->size;
+			break;
+		}
+		case FS_WRITE: {
+			struct write_file *p = (struct write_file *)guest_span(vm, vcpu, (uintptr_t)fh->op_struct, sizeof(*p));
+			if(p == NULL) break;
+			a[0] = p->fd;
+			a[1] = p->count;
+			a[2] = trace_hash(guest_span(vm, vcpu, (uintptr_t)p->buf, p->count), p->count);
+			break;
+		}
+		case FS_LSEEK: {
+			struct lseek_file *p = (struct lseek_file *)guest_span(vm, vcpu, (uintptr_t)fh->op_struct, sizeof(*p));
+			if(p == NULL) break;
+			a[0] = p->fd;
+			a[1] = p->offset;
+			a[2] = p->whence;
+			break;
+		}
+		case FS_COPY: {
+			struct copy_file *p = (struct copy_file *)guest_span(vm, vcpu, (uintptr_t)fh->op_struct, sizeof(*p));
+			if(p == NULL) break;
+			a[0] = p->fd_in;
+			a[1] = p->fd_out;
+			a[2] = p->len;
+			break;
+		}
+		}
+	} else if(port == HC_PORT) {
+		struct hc_req *req = (struct hc_req *)guest_phys(vm, (uint64_t)val << HC_SHIFT, sizeof(struct hc_req));
+		if(req == NULL) return op;
+		op = req->op;
+		a[0] = req->version;
+		switch(req->op) {
+		case FS_OPEN: {
+			char *path = guest_phys_string(vm, req->open.pathname, MAX_PATHNAME);
+			a[0] = req->open.flags;
+			a[1] = req->open.mode;
+			a[2] = trace_hash(path, path == NULL ? 0 : strlen(path));
+			break;
+		}
+		case FS_READ:
+		case FS_WRITE:
+			a[0] = req->rw.fd;
+			a[1] = req->rw.count;
+			if(req->op == FS_WRITE) a[2] = trace_hash(guest_phys(vm, req->rw.buf, req->rw.count), req->rw.count);
+			break;
+		case FS_LSEEK:
+			a[0] = req->lseek.fd;
+			a[1] = req->lseek.offset;
+			a[2] = req->lseek.whence;
+			break;
+		case FS_CLOSE:
+		case FS_ISOPEN:
+			a[0] = req->file.fd;
+			break;
+		case FS_COPY:
+			a[0] = req->copy.fd_in;
+			a[1] = req->copy.fd_out;
+			a[2] = req->copy.len;
+			break;
+		case HC_BALLOON:
+			a[0] = req->balloon.start;
+			a[1] = req->balloon.len;
+			a[2] = req->balloon.op;
+			break;
+		}
+	} else if(port == BALLOON_PORT) {
+		guest_mmu_sync(vcpu);
+		struct balloon_req *req = (struct balloon_req *)guest_span(vm, vcpu, val, sizeof(struct balloon_req));
+		if(req == NULL) return op;
+		op = req->op;
+		a[0] = (uintptr_t)req->start;
+		a[1] = req->len;
+	}
+	return op;
+}
+
+void trace_begin_exit(struct vm *vm, struct vcpu *vcpu) { // called just after KVM_RUN returns.
+	struct kvm_run *run = vcpu->kvm_run;
+	memset(&trace_cur, 0, sizeof(trace_cur));
+	trace_cur.ts_ns = now_ns() - trace_start_ns;
+	trace_cur.reason = run->exit_reason;
+	trace_cur.op = 0xff;
+	if(run->exit_reason == KVM_EXIT_IO) {
+		trace_cur.port = run->io.port;
+		trace_cur.direction = run->io.direction;
+		trace_cur.size = run->io.size;
+		if(run->io.direction == KVM_EXIT_IO_OUT) {
+			memcpy(&trace_cur.data, (char *)run + run->io.data_offset, run->io.size < 4 ? run->io.size : 4);
+			int32_t args[3] = {0, 0, 0};
+			trace_cur.op = trace_request(vm, vcpu, run->io.port, trace_cur.data, args);
+			memcpy(trace_cur.args, args, sizeof(args));
+		}
+	}
+	trace_fh = NULL;
+	trace_req = NULL;
+	trace_buf = NULL;
+	trace_pending = 1;
+}
+
+int trace_add_patch(struct vm *vm, struct trace_patch *patch, void *ptr, long len) {
+	if(len <= 0 || validate_guest_addr(vm, ptr, len) == FALSE) return 0;
+	patch->gpa = (char *)ptr - vm->mem;
+	patch->len = len;
+	return 1;
+}
+
+void trace_record_exit(struct vm *vm, struct vcpu *vcpu) { // called before next KVM_RUN, when host is done with the exit.
+	struct kvm_run *run = vcpu->kvm_run;
+	struct trace_patch patch[TRACE_MAX_PATCH];
+	int n = 0;
+
+	if(!trace_pending) return;
+	trace_pending = 0;
+	if(run->exit_reason == KVM_EXIT_IO && run->io.direction == KVM_EXIT_IO_IN)
+		memcpy(&trace_cur.data, (char *)run + run->io.data_offset, run->io.size < 4 ? run->io.size : 4);
+
+	if(trace_fh != NULL) { // results of FS op are in the file handler, op struct and read buffer.
+		char *op_struct = guest_span(vm, vcpu, (uintptr_t)trace_fh->op_struct, 1); // patch size is checked below.
+		n += trace_add_patch(vm, &patch[n], trace_fh, sizeof(struct file_handler));
+		switch(op_struct == NULL ? -1 : trace_fh->op) {
+		case FS_OPEN: {
+			struct open_file *p = (struct open_file *)op_struct;
+			if(trace_add_patch(vm, &patch[n], p, sizeof(*p)) == 0) break;
+			n++;
+			trace_cur.result = p->fd;
+			break;
+		}
+		case FS_READ: {
+			struct read_file *p = (struct read_file *)op_struct;
+			if(trace_add_patch(vm, &patch[n], p, sizeof(*p)) == 0) break;
+			n++;
+			trace_cur.result = p->ssize;
+			n += trace_add_patch(vm, &patch[n], guest_span(vm, vcpu, (uintptr_t)p->buf, p->ssize > 0 ? p->ssize : 0), p->ssize);
+			break;
+		}
+		case FS_WRITE: {
+			struct write_file *p = (struct write_file *)op_struct;
+			if(trace_add_patch(vm, &patch[n], p, sizeof(*p)) == 0) break;
+			n++;
+			trace_cur.result = p->ssize;
+			break;
+		}
+		case FS_LSEEK: {
+			struct lseek_file *p = (struct lseek_file *)op_struct;
+			if(trace_add_patch(vm, &patch[n], p, sizeof(*p)) == 0) break;
+			n++;
+			trace_cur.result = p->foffset;
+			break;
+		}
+		case FS_COPY: {
+			struct copy_file *p = (struct copy_file *)op_struct;
+			if(trace_add_patch(vm, &patch[n], p, sizeof(*p)) == 0) break;
+			n++;
+			trace_cur.result = p->ssize;
+			break;
+		}
+		default: // FS_CLOSE, FS_ISOPEN only use file handler.
+			trace_cur.result = trace_fh->flag;
+		}
+	}
+
+	if(trace_req != NULL)
+		n += trace_add_patch(vm, &patch[n], trace_req, trace_req_len);
+	if(trace_buf != NULL)
+		n += trace_add_patch(vm, &patch[n], trace_buf, trace_buf_len);
+
+	trace_cur.handle_ns = now_ns() - trace_start_ns - trace_cur.ts_ns;
+	trace_cur.npatch = n;
+	trace_handle_total += trace_cur.handle_ns;
+	trace_count++;
+	fwrite(&trace_cur, sizeof(trace_cur), 1, trace_fp);
+	for(int i = 0; i < n; i++) {
+		fwrite(&patch[i], sizeof(patch[i]), 1, trace_fp);
+		fwrite(vm->mem + patch[i].gpa, patch[i].len, 1, trace_fp);
+	}
+}
+
+int trace_replay_exit(struct vm *vm, struct vcpu *vcpu) { // handle the exit from trace instead of host. returns exit reason.
+	struct kvm_run *run = vcpu->kvm_run;
+	struct trace_exit rec;
+	struct trace_patch patch;
+
+	if(fread(&rec, sizeof(rec), 1, trace_fp) != 1) {
+		fprintf(stderr, "Host: trace ended at exit %u but guest is still running\n", trace_count);
+		exit(1);
+	}
+	if(rec.reason != trace_cur.reason || rec.port != trace_cur.port || rec.direction != trace_cur.direction) {
+		fprintf(stderr, "Host: replay diverged at exit %u: got exit_reason %d port 0x%x, recorded exit_reason %d port 0x%x\n",
+			trace_count, trace_cur.reason, trace_cur.port, rec.reason, rec.port);
+		exit(1);
+	}
+	if(rec.direction == KVM_EXIT_IO_OUT && (rec.data != trace_cur.data || rec.op != trace_cur.op
+	   || memcmp(rec.args, trace_cur.args, sizeof(rec.args)) != 0)) {
+		fprintf(stderr, "Host: replay diverged at exit %u on port 0x%x: got data 0x%x op %d args %d %d %d, "
+			"recorded data 0x%x op %d args %d %d %d\n", trace_count, rec.port, trace_cur.data, trace_cur.op,
+			trace_cur.args[0], trace_cur.args[1], trace_cur.args[2], rec.data, rec.op, rec.args[0], rec.args[1], rec.args[2]);
+		exit(1);
+	}
+	for(int i = 0; i < rec.npatch; i++) {
+		if(fread(&patch, sizeof(patch), 1, trace_fp) != 1
+		   || guest_phys(vm, patch.gpa, patch.len) == NULL
+		   || fread(vm->mem + patch.gpa, patch.len, 1, trace_fp) != 1) {
+			fprintf(stderr, "Host: corrupted trace at exit %u\n", trace_count);
+			exit(1);
+		}
+	}
+	if(rec.reason == KVM_EXIT_IO && rec.direction == KVM_EXIT_IO_IN)
+		memcpy((char *)run + run->io.data_offset, &rec.data, run->io.size < 4 ? run->io.size : 4);
+
+	trace_recorded_total += rec.handle_ns;
+	trace_handle_total += now_ns() - trace_start_ns - trace_cur.ts_ns;
+	trace_pending = 0;
+	trace_count++;
+	return rec.reason;
+}
+
+//////////////////////////////////////// I/O limits and fair queue ////////////////////////////////////////
+// FS hypercalls run on the vcpu thread, so without limits one guest writing in a loop takes all the disk bandwidth there is.
+// -L hc,bytes,iops gives every VM token buckets for FS hypercalls per second, bytes per second and file reads/writes/copies per
+// second (0 = no limit). a request is let in while no bucket is in debt and charged with what it really did afterwards, so a
+// request bigger than a bucket still goes through, the next ones wait. a hypercall which is not let in is left in kvm_run and
+// its run loop returns VCPU_THROTTLED: a worker runs other guests meanwhile, a single guest sleeps. it is handled before the
+// next KVM_RUN, guest just sees a slow OUT.
+// -Q depth puts a start time fair queue (SFQ(D)) in front of the files: at most depth reads/writes/copies of all VMs are in
+// the kernel at once, the others are let in in order of their start tags. a VM's tags grow with the bytes it moves, so a guest
+// which moves a lot waits behind guests which move little, which keeps their latency low whatever it does.
+#define FQ_OP_COST 4096		// bytes an operation costs on top of what it moves, so small ones are not free.
+
+double io_limit_hc, io_limit_bytes, io_limit_iops;	// per second, 0 = no limit.
+int fq_depth;	// 0 = no fair queue.
+
+pthread_mutex_t fq_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t fq_cond = PTHREAD_COND_INITIALIZER;
+uint64_t fq_vtime;	// start tag of last request let in.
+int fq_in_flight;
+
+struct fq_waiter {
+	uint64_t start;
+	struct fq_waiter *next;
+};
+struct fq_waiter *fq_waiters;	// sorted by start tag.
+
+void bucket_refill(struct token_bucket *b, double rate, uint64_t now) {
+	double burst = rate / 10 > 1 ? rate / 10 : 1; // 100 ms worth.
+
+	if (b->last_ns == 0) b->tokens = burst;
+	else b->tokens += (now - b->last_ns) * rate / 1e9;
+	if (b->tokens > burst) b->tokens = burst;
+	b->last_ns = now;
+}
+
+uint64_t bucket_wait_ns(struct token_bucket *b, double rate) { // till bucket is out of debt.
+	return rate > 0 && b->tokens < 0 ? (uint64_t)(-b->tokens * 1e9 / rate) + 1 : 0;
+}
+
+// call when an FS hypercall comes, returns 1 if it has to be put off (vm->io.until is set then).
+int io_throttle(struct vm *vm) {
+	struct vm_io *io = &vm->io;
+	uint64_t now = now_ns(), wait = 0, w;
+
+	if (io_limit_hc == 0 && io_limit_bytes == 0 && io_limit_iops == 0) return 0;
+	if (io_limit_hc > 0) bucket_refill(&io->hc, io_limit_hc, now);
+	if (io_limit_bytes > 0) bucket_refill(&io->bytes, io_limit_bytes, now);
+	if (io_limit_iops > 0) bucket_refill(&io->iops, io_limit_iops, now);
+	if ((w = bucket_wait_ns(&io->hc, io_limit_hc)) > wait) wait = w;
+	if ((w = bucket_wait_ns(&io->bytes, io_limit_bytes)) > wait) wait = w;
+	if ((w = bucket_wait_ns(&io->iops, io_limit_iops)) > wait) wait = w;
+	if (wait > 0) {
+		io->until = now + wait;
+		vm->stats.throttled++;
+		vm->stats.throttle_ns += wait;
+		return 1;
+	}
+	io->until = 0;
+	io->hc.tokens -= 1;
+	return 0;
+}
+
+void io_charge(struct vm *vm, long bytes) { // a read/write/copy was done.
+	vm->io.iops.tokens -= 1;
+	if (bytes > 0) vm->io.bytes.tokens -= bytes;
+}
+
+void throttle_sleep(struct vm *vm) { // single guest, nothing else to run till its hypercall is let in.
+	struct timespec ts = { vm->io.until / 1000000000, vm->io.until % 1000000000 };
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+		;
+}
+
+void fq_enter(struct vm *vm, uint64_t bytes) {
+	if (fq_depth == 0) return;
+	pthread_mutex_lock(&fq_lock);
+	uint64_t start = vm->io.fq_finish > fq_vtime ? vm->io.fq_finish : fq_vtime;
+	vm->io.fq_finish = start + FQ_OP_COST + bytes;
+	if (fq_in_flight >= fq_depth || fq_waiters != NULL) {
+		struct fq_waiter me = { start, NULL }, **pp = &fq_waiters;
+		uint64_t t = now_ns();
+		while (*pp != NULL && (*pp)->start <= start)
+			pp = &(*pp)->next;
+		me.next = *pp;
+		*pp = &me;
+		while (fq_in_flight >= fq_depth || fq_waiters != &me)
+			pthread_cond_wait(&fq_cond, &fq_lock);
+		fq_waiters = me.next;
+		pthread_cond_broadcast(&fq_cond); // next one may fit too.
+		vm->stats.fq_waits++;
+		vm->stats.fq_wait_ns += now_ns() - t;
+	}
+	if (start > fq_vtime) fq_vtime = start;
+	fq_in_flight++;
+	pthread_mutex_unlock(&fq_lock);
+}
+
+void fq_exit() {
+	if (fq_depth == 0) return;
+	pthread_mutex_lock(&fq_lock);
+	fq_in_flight--;
+	pthread_cond_broadcast(&fq_cond);
+	pthread_mutex_unlock(&fq_lock);
+}
+
+void print_io_stats(struct vm *vm) {
+	struct vm_stats *st = &vm->stats;
+	if (st->throttled == 0 && st->fq_waits == 0) return;
+	printf("VM %d: FS hypercalls throttled %lu times for %lu us, waited in fair queue %lu times for %lu us\n", vm->id,
+	       st->throttled, st->throttle_ns / 1000, st->fq_waits, st->fq_wait_ns / 1000);
+}
+
+// file operations behind FS_PORT and HC_PORT hypercalls, guest pointers are already resolved to host pointers.
+// they return what guest gets back: guest fd, byte count or file offset, -1 on error.
+long fs_open(struct vm *vm, char *pathname, int gflags, int gmode) {
+	int fd, flags, mode;
+	flags = get_open_flags(gflags);
+	mode = get_open_mode(gmode);
+	struct fd_pool_entry *pool;
+	if(flags != -1 && gmode == -1)
+		fd = fd_pool_get(pathname, flags, 0, &pool);
+	else if(flags != -1 && mode != -1){
+		fd = fd_pool_get(pathname, flags, mode, &pool);
+	} else {
+		printf("Host: INVALID flags or mode\n");
+		return -1;
+	}
+	if(fd < 0) {
+		fprintf(stderr, "%s\n", strerror(errno));
+		printf("Host: Stderror\n");
+		return -1;
+	}
+
+	struct open_file_entry *eptr = make_entry(vm);
+	eptr->fd = fd;
+	eptr->pool = pool;
+	eptr->offset = 0;
+	strcpy(eptr->pathname, pathname);
+	debug_printf("\nHost: opening file with pathname:%s", eptr->pathname);
+	if (CONFIG_DEBUG) print_file_table(vm);
+	return eptr->guest_fd;
+}
+
+long fs_read(struct vm *vm, int guest_fd, char *buf, size_t size) {
+	struct open_file_entry *eptr = get_entry(vm, guest_fd);
+	if(eptr == NULL) {
+		printf("Host: File is not open\n");
+		return -1;
+	}
+	fq_enter(vm, size);
+	long ssize = pread(eptr->fd, buf, size, eptr->offset);
+	fq_exit();
+	if(ssize > 0) eptr->offset += ssize;
+	io_charge(vm, ssize);
+	return ssize;
+}
+
+long fs_write(struct vm *vm, int guest_fd, char *buf, size_t count) {
+	struct open_file_entry *eptr = get_entry(vm, guest_fd);
+	if(eptr == NULL) {
+		printf("Host: File is not open\n");
+		return -1;
+	}
+	count = strnlen(buf, count);
+	fq_enter(vm, count);
+	long ssize = pwrite(eptr->fd, buf, count, eptr->offset); // if binary data is written in sublime try opening in default text editor.
+	fq_exit();
+	struct stat st;
+	if(ssize > 0 && (fcntl(eptr->fd, F_GETFL) & O_APPEND) && fstat(eptr->fd, &st) == 0)
+		eptr->offset = st.st_size; // pwrite() appends on O_APPEND fds whatever the offset.
+	else if(ssize > 0)
+		eptr->offset += ssize;
+	io_charge(vm, ssize);
+	debug_printf("Host: write ssize:%ld\n", ssize);
+	return ssize;
+}
+
+long fs_close(struct vm *vm, int guest_fd) {
+	struct open_file_entry *eptr = get_entry(vm, guest_fd);
+	if(eptr == NULL) {
+		printf("Host: File is not open\n");
+		return -1;
+	}
+	fd_pool_put(eptr->pool, eptr->fd);
+	eptr->fd = -1;
+	int ret = 0;
+
+	debug_printf("\nHost: closing file with pathname:%s", eptr->pathname);
+	if (CONFIG_DEBUG) print_file_table(vm);
+	return ret;
+}
+
+long fs_lseek(struct vm *vm, int guest_fd, int64_t offset, int gwhence) {
+	struct open_file_entry *eptr = get_entry(vm, guest_fd);
+	if(eptr == NULL) {
+		printf("Host: File is not open\n");
+		return -1;
+	}
+	// offset is guest fd's own, host fd may be shared with other guest fds.
+	long foffset = -1;
+	struct stat st;
+	int whence = get_lseek_whence(gwhence);
+	if(whence == SEEK_SET) foffset = offset;
+	else if(whence == SEEK_CUR) foffset = eptr->offset + offset;
+	else if(whence == SEEK_END && fstat(eptr->fd, &st) == 0) foffset = st.st_size + offset;
+	if(foffset >= 0) eptr->offset = foffset;
+	else foffset = -1;
+	debug_printf("Host: lseek foffset:%ld\n", foffset);
+	return foffset;
+}
+
+long fs_copy(struct vm *vm, int fd_in, int64_t off_in, int fd_out, int64_t off_out, uint64_t len) {
+	struct open_file_entry *in_ptr = get_entry(vm, fd_in);
+	struct open_file_entry *out_ptr = get_entry(vm, fd_out);
+	if(in_ptr == NULL || out_ptr == NULL) {
+		printf("Host: File is not open\n");
+		return -1;
+	}
+	// data goes file to file inside host kernel, guest memory is never touched so no MAX_DATA limit here.
+	// off of -1 means guest fd's offset, which host fd does not have (it may be shared) so it is passed and advanced here.
+	// O_APPEND output is left to the kernel.
+	int64_t oin = off_in < 0 ? in_ptr->offset : off_in;
+	int append = fcntl(out_ptr->fd, F_GETFL) & O_APPEND;
+	int64_t oout = off_out < 0 && !append ? out_ptr->offset : off_out;
+	fq_enter(vm, len);
+	long ssize = copy_host_file(in_ptr->fd, oin, out_ptr->fd, oout, len);
+	fq_exit();
+	if(ssize > 0 && off_in < 0) in_ptr->offset += ssize;
+	if(ssize > 0 && off_out < 0 && !append) out_ptr->offset += ssize;
+	io_charge(vm, ssize);
+	if(ssize < 0) fprintf(stderr, "%s\n", strerror(errno));
+	debug_printf("Host: copy ssize:%ld\n", ssize);
+	return ssize;
+}
+
+struct fs_probe {	// what fs_end probe reports.
+	int op;
+	int fd;		// guest fd.
+	long size;
+	long result;
+};
+
+// FS_PORT hypercall, guest_mem_addr is guest virtual address of struct file_handler. this is the first ABI: structs have
+// pointers and size_t in them so their layout is that of guest64, guest32 should use HC_PORT (see Hypercall ABI).
+// returns FALSE if file operation is unknown.
+int handle_fs_op(struct vm *vm, struct vcpu *vcpu, uint32_t guest_mem_addr, struct fs_probe *pr) {
+	vm->stats.fs_ops++;
+	guest_mmu_sync(vcpu);
+	struct file_handler *fh_ptr = (struct file_handler *) guest_span(vm, vcpu, guest_mem_addr, sizeof(struct file_handler));
+	if(fh_ptr == NULL) {// should not be more than allocated memory for guest.
+		printf("Host: Invalid File Handler Memory Location\n");
+		return TRUE;
+	}
+	trace_fh = fh_ptr;
+	pr->op = fh_ptr->op;
+
+	if(fh_ptr->op == FS_OPEN) {
+		struct open_file *opn_ptr = (struct open_file *) guest_span(vm, vcpu, (uintptr_t)fh_ptr->op_struct, sizeof(struct open_file));// fh_ptr->op_struct is guest virtual address of op struct.
+		if(opn_ptr == NULL) {
+			printf("Host: Invalid Open Struct Memory Location\n");
+			return TRUE;
+		}
+		char *pathname = guest_string(vm, vcpu, (uintptr_t)opn_ptr->pathname, MAX_PATHNAME);
+		if(pathname == NULL) {
+			printf("Host: Invalid Pathname Memory Location\n");
+			opn_ptr->fd = -1;
+			return TRUE;
+		}
+		opn_ptr->fd = fs_open(vm, pathname, opn_ptr->flags, opn_ptr->mode);
+		pr->fd = pr->result = opn_ptr->fd;
+		return TRUE;
+	}
+	if(fh_ptr->op == FS_READ) {
+		struct read_file *rd_ptr = (struct read_file *) guest_span(vm, vcpu, (uintptr_t)fh_ptr->op_struct, sizeof(struct read_file));
+		if(rd_ptr == NULL) {
+			printf("Host: Invalid Read Struct Memory Location\n");
+			return TRUE;
+		}
+		char *buf = guest_span(vm, vcpu, (uintptr_t)rd_ptr->buf, rd_ptr->size);
+		if(buf == NULL) { // entire buffer should be in guest memory no overflow.
+			printf("Host: Invalid Read Buffer Memory Location\n");
+			rd_ptr->ssize = -1;
+			return TRUE;
+		}
+		rd_ptr->ssize = fs_read(vm, rd_ptr->fd, buf, rd_ptr->size);
+		*pr = (struct fs_probe){FS_READ, rd_ptr->fd, rd_ptr->size, rd_ptr->ssize};
+		return TRUE;
+	}
+	if(fh_ptr->op == FS_WRITE) {
+		struct write_file *wr_ptr = (struct write_file *) guest_span(vm, vcpu, (uintptr_t)fh_ptr->op_struct, sizeof(struct write_file));
+		if(wr_ptr == NULL) {
+			printf("Host: Invalid Write Struct Memory Location\n");
+			return TRUE;
+		}
+		char *buf = guest_span(vm, vcpu, (uintptr_t)wr_ptr->buf, wr_ptr->count);
+		if(buf == NULL) { // entire buffer should be in guest memory no overflow.
+			printf("Host: Invalid Write Buffer Memory Location\n");
+			wr_ptr->ssize = -1;
+			return TRUE;
+		}
+		wr_ptr->count = strnlen(buf, wr_ptr->count);
+		wr_ptr->ssize = fs_write(vm, wr_ptr->fd, buf, wr_ptr->count);
+		*pr = (struct fs_probe){FS_WRITE, wr_ptr->fd, wr_ptr->count, wr_ptr->ssize};
+		return TRUE;
+	}
+	if(fh_ptr->op == FS_CLOSE) {
+		fh_ptr->flag = fs_close(vm, fh_ptr->fd);
+		*pr = (struct fs_probe){FS_CLOSE, fh_ptr->fd, 0, fh_ptr->flag};
+		return TRUE;
+	}
+	if(fh_ptr->op == FS_LSEEK) {
+		struct lseek_file *lsk_ptr = (struct lseek_file *) guest_span(vm, vcpu, (uintptr_t)fh_ptr->op_struct, sizeof(struct lseek_file));
+		if(lsk_ptr == NULL) {
+			printf("Host: Invalid Lseek Struct Memory Location\n");
+			return TRUE;
+		}
+		lsk_ptr->foffset = fs_lseek(vm, lsk_ptr->fd, lsk_ptr->offset, lsk_ptr->whence);
+		*pr = (struct fs_probe){FS_LSEEK, lsk_ptr->fd, lsk_ptr->offset, lsk_ptr->foffset};
+		return TRUE;
+	}
+	if(fh_ptr->op == FS_COPY) {
+		struct copy_file *cpy_ptr = (struct copy_file *) guest_span(vm, vcpu, (uintptr_t)fh_ptr->op_struct, sizeof(struct copy_file));
+		if(cpy_ptr == NULL) {
+			printf("Host: Invalid Copy Struct Memory Location\n");
+			return TRUE;
+		}
+		cpy_ptr->ssize = fs_copy(vm, cpy_ptr->fd_in, cpy_ptr->off_in, cpy_ptr->fd_out, cpy_ptr->off_out, cpy_ptr->len);
+		*pr = (struct fs_probe){FS_COPY, cpy_ptr->fd_in, cpy_ptr->len, cpy_ptr->ssize};
+		return TRUE;
+	}
+	if(fh_ptr->op == FS_ISOPEN) {
+		if(is_valid_fd(vm, fh_ptr->fd) == TRUE) fh_ptr->flag = 1;
+		else fh_ptr->flag = 0;
+		*pr = (struct fs_probe){FS_ISOPEN, fh_ptr->fd, 0, fh_ptr->flag};
+		return TRUE;
+	}
+
+	printf("Host: INVALID FILE OPERATION\n");
+	return FALSE;
+}
+
+int handle_fs(struct vm *vm, struct vcpu *vcpu, uint32_t guest_mem_addr) {
+	struct fs_probe pr = {-1, -1, 0, -1};
+	if(io_throttle(vm)) return TRUE; // run loop sees vm->io.until.
+	PROBE(fs_start, vm->id, guest_mem_addr);
+	int ret = handle_fs_op(vm, vcpu, guest_mem_addr, &pr);
+	PROBE(fs_end, vm->id, pr.op, pr.fd, pr.size, pr.result);
+	return ret;
+}
+
+//////////////////////////////////////// Host dedup ////////////////////////////////////////
+// -K ms: instead of leaving guest RAM to KSM, which scans on its own schedule, host merges identical pages of all VMs itself.
+// a VM is scanned by its worker between time slices (or after a reset), at most once per ms, when its vcpu is not running and
+// nothing but the vcpu writes its RAM (VMs with a disk are not scanned, I/O thread writes RAM at any time). only pages in KVM's
+// dirty log are hashed again, every DEDUP_FULL_EVERY scans and after a reset all resident pages are, host writes on hypercalls
+// are not in the dirty log. a page which hashes like a page seen before (on any VM) is copied into a memfd once and then every
+// such page is mapped MAP_PRIVATE|MAP_FIXED from it: same content, one physical page, copy on write when guest writes it. KVM
+// follows the remap through its MMU notifier. hashes only pick candidates, content is compared before every remap.
+// madvise() on a merged page would give back memfd content instead of zero, so balloon and reset unmerge pages first.
+#define DEDUP_TABLE (1 << 16)	// hash table entries, distinct page contents tracked.
+#define DEDUP_MAX_PAGES 16384	// shared pages, every merged page costs a VMA (vm.max_map_count).
+#define DEDUP_FULL_EVERY 16
+
+enum { DEDUP_PRIVATE, DEDUP_MERGED };
+enum { DEDUP_UNREF = 1, DEDUP_LOOKUP = 2 }; // dedup_vm.pending bits.
+
+struct dedup_vm {
+	uint64_t *hash;		// per page, hash at last scan, 0 for zero or not resident pages.
+	unsigned char *state;	// per page, DEDUP_PRIVATE or DEDUP_MERGED.
+	int32_t *slot;		// per merged page, its shared page in dedup_mem.
+	uint64_t *dirty;	// KVM dirty log bitmap.
+	unsigned char *vec;	// mincore() of full scans.
+	unsigned char *pending;	// per page, DEDUP_UNREF | DEDUP_LOOKUP work for the locked pass of a scan.
+	uint64_t last_ns;	// last scan.
+	int full;		// next scan hashes all resident pages.
+};
+
+struct dedup_entry {
+	uint64_t hash;		// 0 = empty.
+	int32_t slot;		// shared page, -1 till a second page with this hash shows up.
+	uint32_t refs;		// pages mapped from slot.
+	int seen_vm;		// first page seen with this hash, -1 if none.
+	uint64_t seen_gpa;
+};
+
+pthread_mutex_t dedup_lock = PTHREAD_MUTEX_INITIALIZER;
+struct dedup_entry *dedup_table;
+int dedup_entries;
+int dedup_fd = -1;		// memfd with the shared pages,
+char *dedup_mem;		// mapped here for comparing and filling them.
+uint64_t *dedup_slot_hash;	// hash of content of each slot.
+int32_t *dedup_free;		// free slots, stack.
+int dedup_nr_free;
+
+int page_is_zero(const char *page) {
+	static const char zero[PAGE_SIZE];
+	return memcmp(page, zero, PAGE_SIZE) == 0;
+}
+
+// 4 lanes of multiply-xor over the page, GCC vector extensions turn it into SIMD code on any x86-64 (-O2 has no
+// auto-vectorization). only finds candidates, so it need not be strong. never returns 0.
+typedef uint64_t dedup_v4 __attribute__((vector_size(32)));
+
+uint64_t page_hash(const char *page) {
+	dedup_v4 h = { 0x243f6a8885a308d3ull, 0x13198a2e03707344ull, 0xa4093822299f31d0ull, 0x082efa98ec4e6c89ull };
+	const dedup_v4 k = { 0x9e3779b97f4a7c15ull, 0x9e3779b97f4a7c15ull, 0x9e3779b97f4a7c15ull, 0x9e3779b97f4a7c15ull };
+
+	for (size_t i = 0; i < PAGE_SIZE; i += sizeof(dedup_v4)) {
+		dedup_v4 w;
+		memcpy(&w, page + i, sizeof(w));
+		h = (h ^ w) * k;
+		h ^= h >> 29;
+	}
+	uint64_t r = h[0] ^ (h[1] * 31) ^ (h[2] * 961) ^ (h[3] * 29791);
+	r ^= r >> 32;
+	return r ? r : 1;
+}
+
+void dedup_init() {
+	dedup_fd = memfd_create("kvm-hello-dedup", MFD_CLOEXEC);
+	if (dedup_fd < 0 || ftruncate(dedup_fd, (off_t)DEDUP_MAX_PAGES * PAGE_SIZE) < 0) {
+		perror("dedup memfd");
+		exit(1);
+	}
+	dedup_mem = mmap(NULL, (size_t)DEDUP_MAX_PAGES * PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, dedup_fd, 0);
+	if (dedup_mem == MAP_FAILED) {
+		perror("mmap dedup memfd");
+		exit(1);
+	}
+	dedup_table = calloc(DEDUP_TABLE, sizeof(struct dedup_entry));
+	dedup_slot_hash = calloc(DEDUP_MAX_PAGES, sizeof(uint64_t));
+	dedup_free = malloc(DEDUP_MAX_PAGES * sizeof(int32_t));
+	for (int i = 0; i < DEDUP_MAX_PAGES; i++)
+		dedup_free[dedup_nr_free++] = DEDUP_MAX_PAGES - 1 - i;
+}
+
+void dedup_attach(struct vm *vm) { // after vm_init(), before guest runs.
+	struct dedup_vm *d = calloc(1, sizeof(struct dedup_vm));
+	size_t pages = vm->mem_size / PAGE_SIZE;
+
+	d->hash = calloc(pages, sizeof(uint64_t));
+	d->state = calloc(pages, 1);
+	d->slot = calloc(pages, sizeof(int32_t));
+	d->dirty = calloc((pages + 63) / 64, sizeof(uint64_t));
+	d->vec = malloc(pages);
+	d->pending = malloc(pages);
+	d->full = 1;
+	vm->dedup = d;
+}
+
+struct dedup_entry *dedup_find(uint64_t hash, int insert) { // open addressing, table is rebuilt before it gets full.
+	for (uint32_t i = hash & (DEDUP_TABLE - 1);; i = (i + 1) & (DEDUP_TABLE - 1)) {
+		struct dedup_entry *e = &dedup_table[i];
+		if (e->hash == hash) return e;
+		if (e->hash != 0) continue;
+		if (!insert) return NULL;
+		*e = (struct dedup_entry){ .hash = hash, .slot = -1, .seen_vm = -1 };
+		dedup_entries++;
+		return e;
+	}
+}
+
+void dedup_rebuild() { // drops entries with no shared page, most are pages which changed since they were hashed.
+	struct dedup_entry *old = dedup_table;
+
+	dedup_table = calloc(DEDUP_TABLE, sizeof(struct dedup_entry));
+	dedup_entries = 0;
+	for (int i = 0; i < DEDUP_TABLE; i++)
+		if (old[i].hash != 0 && old[i].slot >= 0) *dedup_find(old[i].hash, 1) = old[i];
+	free(old);
+}
+
+void dedup_unref(int32_t slot) {
+	struct dedup_entry *e = dedup_find(dedup_slot_hash[slot], 0);
+
+	if (e == NULL || e->slot != slot || --e->refs > 0) return;
+	if (fallocate(dedup_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, (off_t)slot * PAGE_SIZE, PAGE_SIZE) < 0)
+		perror("dedup punch hole");
+	dedup_free[dedup_nr_free++] = slot;
+	e->slot = -1;
+	e->seen_vm = -1;
+}
+
+int dedup_merge(struct vm *vm, size_t page, struct dedup_entry *e) { // vcpu of vm is not running. returns 1 if merged.
+	struct dedup_vm *d = vm->dedup;
+	char *hva = vm->mem + page * PAGE_SIZE;
+
+	if (e->slot < 0) { // first copy of this content becomes the shared page.
+		if (dedup_nr_free == 0) return 0;
+		e->slot = dedup_free[--dedup_nr_free];
+		memcpy(dedup_mem + (size_t)e->slot * PAGE_SIZE, hva, PAGE_SIZE);
+		dedup_slot_hash[e->slot] = e->hash;
+	} else if (memcmp(hva, dedup_mem + (size_t)e->slot * PAGE_SIZE, PAGE_SIZE) != 0) {
+		return 0; // hash collision.
+	}
+	e->refs++;
+	if (mmap(hva, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, dedup_fd, (off_t)e->slot * PAGE_SIZE) == MAP_FAILED) {
+		perror("dedup mmap"); // old mapping is still there.
+		dedup_unref(e->slot);
+		return 0;
+	}
+	d->state[page] = DEDUP_MERGED;
+	d->slot[page] = e->slot;
+	vm->stats.dedup_merged++;
+	return 1;
+}
+
+void dedup_scan(struct vm *vm) { // vcpu of vm is not running.
+	struct dedup_vm *d = vm->dedup;
+	size_t pages = vm->mem_size / PAGE_SIZE;
+	struct kvm_dirty_log log = { .slot = 0, .dirty_bitmap = d->dirty };
+	uint64_t t = now_ns();
+	int full = d->full || vm->stats.dedup_scans % DEDUP_FULL_EVERY == 0;
+
+	if (ioctl(vm->fd, KVM_GET_DIRTY_LOG, &log) < 0) { // also clears it for full scans.
+		perror("KVM_GET_DIRTY_LOG");
+		return;
+	}
+	if (full && mincore(vm->mem, vm->mem_size, d->vec) < 0) {
+		perror("mincore dedup");
+		return;
+	}
+	for (size_t i = 0; i < pages; i++) { // hash without dedup_lock, only this vm touches its pages.
+		int dirty = (d->dirty[i / 64] >> (i % 64)) & 1;
+		d->pending[i] = 0;
+		if (!(full ? d->vec[i] & 1 : dirty)) continue;
+		char *hva = vm->mem + i * PAGE_SIZE;
+
+		if (d->state[i] == DEDUP_MERGED) { // guest or host wrote it, it is a private copy now.
+			if (!dirty && memcmp(hva, dedup_mem + (size_t)d->slot[i] * PAGE_SIZE, PAGE_SIZE) == 0) continue; // our ref keeps the slot.
+			d->pending[i] = DEDUP_UNREF;
+		}
+		d->hash[i] = 0;
+		if (page_is_zero(hva)) continue; // kernel already shares zero pages.
+		d->hash[i] = page_hash(hva);
+		d->pending[i] |= DEDUP_LOOKUP;
+		vm->stats.dedup_hashed++;
+	}
+	pthread_mutex_lock(&dedup_lock);
+	if (dedup_entries > DEDUP_TABLE / 4 * 3) dedup_rebuild();
+	for (size_t i = 0; i < pages; i++) {
+		if (d->pending[i] & DEDUP_UNREF) {
+			dedup_unref(d->slot[i]);
+			d->state[i] = DEDUP_PRIVATE;
+			vm->stats.dedup_merged--;
+		}
+		if (!(d->pending[i] & DEDUP_LOOKUP)) continue;
+
+		struct dedup_entry *e = dedup_find(d->hash[i], dedup_entries < DEDUP_TABLE - 1);
+		if (e == NULL) continue;
+		if (e->slot < 0 && (e->seen_vm < 0 || (e->seen_vm == vm->id && e->seen_gpa == i * PAGE_SIZE))) {
+			e->seen_vm = vm->id; // only this page has it so far.
+			e->seen_gpa = i * PAGE_SIZE;
+			continue;
+		}
+		dedup_merge(vm, i, e);
+	}
+	pthread_mutex_unlock(&dedup_lock);
+	d->full = 0;
+	d->last_ns = now_ns();
+	vm->stats.dedup_scans++;
+	vm->stats.dedup_scan_ns += d->last_ns - t;
+}
+
+void dedup_scan_due(struct vm *vm) {
+	if (vm->dedup != NULL && now_ns() - vm->dedup->last_ns >= (uint64_t)dedup_ms * 1000000) dedup_scan(vm);
+}
+
+// merged pages of [gpa, gpa+len) get back anonymous zero pages, for ranges which are about to be dropped.
+void dedup_unmerge(struct vm *vm, uint64_t gpa, uint64_t len) {
+	struct dedup_vm *d = vm->dedup;
+
+	if (d == NULL || vm->stats.dedup_merged == 0) return;
+	pthread_mutex_lock(&dedup_lock);
+	for (size_t i = gpa / PAGE_SIZE; i < (gpa + len) / PAGE_SIZE; i++) {
+		if (d->state[i] != DEDUP_MERGED) continue;
+		char *hva = vm->mem + i * PAGE_SIZE;
+		if (mmap(hva, PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1, 0) == MAP_FAILED) {
+			perror("dedup unmerge");
+			exit(1); // guest would see shared content where it expects zero.
+		}
+		if (numa_node >= 0) bind_guest_ram(hva, PAGE_SIZE, numa_node);
+		dedup_unref(d->slot[i]);
+		d->state[i] = DEDUP_PRIVATE;
+		d->hash[i] = 0;
+		vm->stats.dedup_merged--;
+	}
+	pthread_mutex_unlock(&dedup_lock);
+}
+
+void print_dedup_stats(struct vm **vms, int nr) {
+	uint64_t scans = 0, ns = 0, hashed = 0, merged = 0;
+
+	for (int i = 0; i < nr; i++) {
+		scans += vms[i]->stats.dedup_scans;
+		ns += vms[i]->stats.dedup_scan_ns;
+		hashed += vms[i]->stats.dedup_hashed;
+		merged += vms[i]->stats.dedup_merged;
+	}
+	uint64_t shared = DEDUP_MAX_PAGES - dedup_nr_free;
+	printf("Host dedup: %lu scans, %lu us each, %lu pages hashed (%lu ns of scan per hashed page), %lu pages merged into %lu shared pages (%.1f:1), %lu KB saved\n",
+	       scans, scans ? ns / scans / 1000 : 0, hashed, hashed ? ns / hashed : 0, merged, shared, shared ? (double)merged / shared : 0.0,
+	       merged > shared ? (merged - shared) * PAGE_SIZE / 1024 : 0);
+}
+
+//////////////////////////////////////// Balloon ////////////////////////////////////////
+// guest reports ranges of its free memory on BALLOON_PORT and host gives those pages back to the kernel, so host RSS follows
+// what guest really uses instead of its RAM size (KSM can only merge duplicate pages and it is slow).
+// host asks guest to inflate with a target: IN on BALLOON_PORT returns the number of pages host wants back. target is set when
+// resident guest RAM is above the -B limit. pages given for the target are dropped at once (MADV_DONTNEED), pages guest reports
+// on its own are MADV_FREE: kernel takes them only under memory pressure and guest reusing them soon costs no page fault.
+uint64_t balloon_limit;	// pages of guest RAM allowed to be resident, 0 = no limit.
+
+unsigned char *vm_mincore(struct vm *vm) { // one byte per page of guest RAM, bit 0 is set if page is resident. NULL on error.
+	static __thread unsigned char *vec;
+	static __thread size_t vec_len;
+	size_t pages = vm->mem_size / PAGE_SIZE;
+
+	if(vec_len < pages) {
+		vec = realloc(vec, pages);
+		vec_len = pages;
+	}
+	return mincore(vm->mem, vm->mem_size, vec) < 0 ? NULL : vec;
+}
+
+uint64_t vm_resident_pages(struct vm *vm) {
+	unsigned char *vec = vm_mincore(vm);
+	uint64_t resident = 0;
+
+	if(vec == NULL) return 0;
+	for(size_t i = 0; i < vm->mem_size / PAGE_SIZE; i++)
+		resident += vec[i] & 1;
+	return resident;
+}
+
+void balloon_update_target(struct vm *vm) {
+	uint64_t resident;
+	if(balloon_limit == 0) return;
+	resident = vm_resident_pages(vm);
+	vm->balloon_target = resident > balloon_limit ? resident - balloon_limit : 0;
+}
+
+// gives physically contiguous run of pages to kernel, first ones (up to what is left of target) at once, the rest lazily.
+// returns pages given.
+uint64_t balloon_drop_run(struct vm *vm, uint64_t gpa, uint64_t len, uint64_t dropped) {
+	dedup_unmerge(vm, gpa, len);
+	uint64_t urgent = vm->balloon_target > dropped ? (vm->balloon_target - dropped) * PAGE_SIZE : 0;
+	if(urgent > len) urgent = len;
+	if(urgent > 0 && madvise(vm->mem + gpa, urgent, MADV_DONTNEED) < 0) {
+		perror("madvise balloon");
+		return 0;
+	}
+	if(len > urgent && madvise(vm->mem + gpa + urgent, len - urgent, MADV_FREE) < 0) {
+		perror("madvise balloon");
+		return urgent / PAGE_SIZE;
+	}
+	return len / PAGE_SIZE;
+}
+
+void balloon_account(struct vm *vm, uint64_t pages) { // pages given by guest, first ones count for the target.
+	uint64_t urgent = pages < vm->balloon_target ? pages : vm->balloon_target;
+	vm->stats.balloon_freed += urgent;
+	vm->stats.balloon_lazy += pages - urgent;
+	vm->balloon_target -= urgent;
+}
+
+// drops pages of guest virtual range [start, start+len). only whole pages inside the range are dropped, they are translated
+// one by one (range need not be physically contiguous) and physically contiguous runs are given to madvise() together.
+uint64_t balloon_inflate(struct vm *vm, struct vcpu *vcpu, uint64_t start, uint64_t len) {
+	uint64_t end = (start + len) & ~(PAGE_SIZE - 1);
+	uint64_t run_gpa = 0, run_len = 0, dropped = 0;
+
+	start = (start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	for(uint64_t gva = start; gva < end; gva += PAGE_SIZE) {
+		uint64_t gpa = guest_translate(vm, &vcpu->mmu, gva);
+		if(gpa != GPA_INVALID && run_len > 0 && gpa == run_gpa + run_len) {
+			run_len += PAGE_SIZE;
+			continue;
+		}
+		if(run_len > 0) dropped += balloon_drop_run(vm, run_gpa, run_len, dropped);
+		run_gpa = gpa;
+		run_len = (gpa == GPA_INVALID || guest_phys(vm, gpa, PAGE_SIZE) == NULL) ? 0 : PAGE_SIZE;
+	}
+	if(run_len > 0) dropped += balloon_drop_run(vm, run_gpa, run_len, dropped);
+	return dropped;
+}
+
+int handle_balloon(struct vm *vm, struct vcpu *vcpu, uint32_t guest_mem_addr) {
+	vm->stats.balloon_ops++;
+	guest_mmu_sync(vcpu);
+	struct balloon_req *req = (struct balloon_req *) guest_span(vm, vcpu, guest_mem_addr, sizeof(struct balloon_req));
+	if(req == NULL) {
+		printf("Host: Invalid Balloon Request Memory Location\n");
+		return TRUE;
+	}
+	trace_req = req;
+	trace_req_len = sizeof(struct balloon_req);
+
+	if(req->op == BALLOON_FREE) {
+		uint64_t pages = balloon_inflate(vm, vcpu, (uintptr_t)req->start, req->len);
+		balloon_account(vm, pages);
+		req->pages = pages; // written after madvise, page of req may have been in the range.
+		return TRUE;
+	}
+	if(req->op == BALLOON_USE) { // nothing to do. pages come back on first touch, zero filled or (MADV_FREE not taken yet) as they were.
+		req->pages = req->len / PAGE_SIZE;
+		vm->stats.balloon_used += req->pages;
+		return TRUE;
+	}
+	printf("Host: INVALID BALLOON OPERATION\n");
+	return FALSE;
+}
+
+// HC_BALLOON, range is guest physical so it is dropped as one run without a page walk. returns pages given or taken back.
+long hc_balloon(struct vm *vm, struct hc_req *req) {
+	uint64_t start = (req->balloon.start + PAGE_SIZE - 1) & ~(PAGE_SIZE - 1);
+	uint64_t end = (req->balloon.start + req->balloon.len) & ~(PAGE_SIZE - 1);
+
+	vm->stats.balloon_ops++;
+	if(req->balloon.op == BALLOON_USE) {
+		vm->stats.balloon_used += req->balloon.len / PAGE_SIZE;
+		return req->balloon.len / PAGE_SIZE;
+	}
+	if(req->balloon.op != BALLOON_FREE) {
+		printf("Host: INVALID BALLOON OPERATION\n");
+		return -1;
+	}
+	if(end <= start || guest_phys(vm, start, end - start) == NULL) return 0;
+	uint64_t pages = balloon_drop_run(vm, start, end - start, 0);
+	balloon_account(vm, pages);
+	return pages;
+}
+
+// one line summary of guest memory, KSM numbers are for whole host(sysfs) since KSM merges pages across VMs.
+long read_ulong_file(const char *path) {
+	long val = -1;
+	FILE *fp = fopen(path, "r");
+	if(fp == NULL) return -1;
+	if(fscanf(fp, "%ld", &val) != 1) val = -1;
+	fclose(fp);
+	return val;
+}
+
+void print_memory_stats(struct vm *vm) {
+	struct vm_stats *st = &vm->stats;
+	printf("Host: first exit after %lu us, page faults minor %lu major %lu\n", st->first_exit_ns / 1000, st->minflt, st->majflt);
+	printf("Host: guest RAM resident %lu KB of %lu KB, balloon freed %lu KB lazy %lu KB deflated %lu KB, KSM pages shared %ld sharing %ld\n",
+	       vm_resident_pages(vm) * PAGE_SIZE / 1024, vm->mem_size / 1024, st->balloon_freed * PAGE_SIZE / 1024,
+	       st->balloon_lazy * PAGE_SIZE / 1024, st->balloon_used * PAGE_SIZE / 1024,
+	       read_ulong_file("/sys/kernel/mm/ksm/pages_shared"), read_ulong_file("/sys/kernel/mm/ksm/pages_sharing"));
+}
+
+//////////////////////////////////////// Hypercall ABI ////////////////////////////////////////
+// HC_PORT hypercalls, see struct hc_req in kvm-header.h. FS_PORT and BALLOON_PORT structs have pointers and size_t in them, host
+// reads them with guest64 layout and a 32 bit OUT can not pass an address above 4 GB. struct hc_req is the same for every guest
+// and all addresses in it are guest physical, so host does not walk guest page tables either. request and buffers have to be
+// in guest RAM (memory slot 0). capabilities granted on HC_HELLO come from the devices of run loop (DEV_FS, DEV_BALLOON).
+
+long hc_fs(struct vm *vm, struct hc_req *req, struct fs_probe *pr) {
+	char *p;
+
+	vm->stats.fs_ops++;
+	pr->op = req->op;
+	switch(req->op) {
+	case FS_OPEN:
+		p = guest_phys_string(vm, req->open.pathname, MAX_PATHNAME);
+		if(p == NULL) {
+			printf("Host: Invalid Pathname Memory Location\n");
+			return -1;
+		}
+		pr->fd = pr->result = fs_open(vm, p, req->open.flags, req->open.mode);
+		return pr->result;
+	case FS_READ:
+	case FS_WRITE:
+		*pr = (struct fs_probe){req->op, req->rw.fd, req->rw.count, -1};
+		p = guest_phys(vm, req->rw.buf, req->rw.count);
+		if(p == NULL) { // entire buffer should be in guest memory no overflow.
+			printf("Host: Invalid Buffer Memory Location\n");
+			return -1;
+		}
+		if(req->op == FS_WRITE) {
+			pr->result = fs_write(vm, req->rw.fd, p, req->rw.count);
+			return pr->result;
+		}
+		pr->result = fs_read(vm, req->rw.fd, p, req->rw.count);
+		trace_buf = p;
+		trace_buf_len = pr->result;
+		return pr->result;
+	case FS_LSEEK:
+		*pr = (struct fs_probe){FS_LSEEK, req->lseek.fd, req->lseek.offset, -1};
+		pr->result = fs_lseek(vm, req->lseek.fd, req->lseek.offset, req->lseek.whence);
+		return pr->result;
+	case FS_CLOSE:
+		*pr = (struct fs_probe){FS_CLOSE, req->file.fd, 0, -1};
+		pr->result = fs_close(vm, req->file.fd);
+		return pr->result;
+	case FS_ISOPEN:
+		*pr = (struct fs_probe){FS_ISOPEN, req->file.fd, 0, is_valid_fd(vm, req->file.fd) == TRUE};
+		return pr->result;
+	case FS_COPY:
+		*pr = (struct fs_probe){FS_COPY, req->copy.fd_in, req->copy.len, -1};
+		pr->result = fs_copy(vm, req->copy.fd_in, req->copy.off_in, req->copy.fd_out, req->copy.off_out, req->copy.len);
+		return pr->result;
+	}
+	return -1;
+}
+
+// returns FALSE if op is unknown.
+int handle_hc(struct vm *vm, uint32_t val, uint64_t caps) {
+	uint64_t gpa = (uint64_t)val << HC_SHIFT;
+	struct hc_req *req = (struct hc_req *)guest_phys(vm, gpa, sizeof(struct hc_req));
+
+	if(req == NULL) {
+		printf("Host: Invalid Hypercall Request Memory Location\n");
+		return TRUE;
+	}
+	trace_req = req;
+	trace_req_len = sizeof(struct hc_req);
+	if(req->version != HC_VERSION) {
+		printf("Host: hypercall ABI version %u is not supported\n", req->version);
+		req->ret = -1;
+		return TRUE;
+	}
+	if(req->op == HC_HELLO) {
+		req->hello.caps &= caps;
+		req->ret = HC_VERSION;
+		return TRUE;
+	}
+	if(req->op == HC_BALLOON) {
+		req->ret = (caps & HC_CAP_BALLOON) ? hc_balloon(vm, req) : -1;
+		return TRUE;
+	}
+	if(req->op > FS_COPY) {
+		printf("Host: INVALID HYPERCALL\n");
+		return FALSE;
+	}
+	if(!(caps & HC_CAP_FS)) {
+		req->ret = -1;
+		return TRUE;
+	}
+	if(io_throttle(vm)) return TRUE; // run loop sees vm->io.until.
+	struct fs_probe pr = {-1, -1, 0, -1};
+	PROBE(fs_start, vm->id, gpa);
+	req->ret = hc_fs(vm, req, &pr);
+	PROBE(fs_end, vm->id, pr.op, pr.fd, pr.size, pr.result);
+	return TRUE;
+}
+
+//////////////////////////////////////// Channel ////////////////////////////////////////
+// two guests of -m ("chan=N" in manifest) share CHAN_SIZE bytes of memory, mapped in both VMs as memory slot 1 at guest physical
+// address CHAN_ADDR, and pass records to each other through the single producer single consumer ring in it (struct chan_ring).
+// host never copies the records. first guest attached to a channel is the producer, second the consumer.
+// every direction has an eventfd as doorbell. OUT on CHAN_DOORBELL is registered as ioeventfd so KVM signals the eventfd itself and
+// the vcpu does not exit to host. IN on CHAN_WAIT waits up to CHAN_WAIT_MS for the doorbell of the peer, but not in poll() on the
+// worker: peer may be queued on the same worker (-w 1 -q 0 never preempts). a guest whose peer did not ring yet is parked like a
+// throttled hypercall, the worker runs other guests and looks at the doorbell again every WAIT_PARK_NS till the deadline (see
+// eventfd_park()). (irqfd would need an in-kernel irqchip and interrupt handler in guest.)
+#define CHAN_WAIT_MS 1
+#define WAIT_PARK_NS 50000	// a parked CHAN_WAIT or BLK_WAIT looks at its eventfd again after this.
+
+struct channel {
+	int id;
+	char *mem;
+	int doorbell[2];	// eventfd rung by producer, by consumer.
+	struct vm *end[2];	// producer, consumer.
+};
+
+struct channel *channels;
+int nr_channels;
+
+struct channel *chan_get(int id) { // channel with id, created on first use.
+	for (int i = 0; i < nr_channels; i++)
+		if (channels[i].id == id) return &channels[i];
+	channels = realloc(channels, (nr_channels + 1) * sizeof(struct channel));
+	struct channel *ch = &channels[nr_channels++];
+	memset(ch, 0, sizeof(*ch));
+	ch->id = id;
+	ch->mem = mmap(NULL, CHAN_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (ch->mem == MAP_FAILED) {
+		perror("mmap channel");
+		exit(1);
+	}
+	for (int i = 0; i < 2; i++) {
+		ch->doorbell[i] = eventfd(0, EFD_NONBLOCK);
+		if (ch->doorbell[i] < 0) {
+			perror("eventfd");
+			exit(1);
+		}
+	}
+	return ch;
+}
+
+// only pointers to channels are kept in VMs, chan_get() may move the array so attach after all channels are created.
+void chan_attach(struct vm *vm, struct channel *ch) {
+	struct kvm_userspace_memory_region memreg;
+	struct kvm_ioeventfd ioev;
+	int end = ch->end[0] == NULL ? 0 : 1;
+
+	if (ch->end[end] != NULL) {
+		fprintf(stderr, "channel %d: more than two guests\n", ch->id);
+		exit(1);
+	}
+	if (vm->mem_size > CHAN_ADDR) {
+		fprintf(stderr, "channel %d: guest RAM overlaps channel at 0x%x\n", ch->id, CHAN_ADDR);
+		exit(1);
+	}
+	ch->end[end] = vm;
+	vm->chan = ch;
+	vm->chan_role = end == 0 ? CHAN_PRODUCER : CHAN_CONSUMER;
+
+	memreg.slot = 1;
+	memreg.flags = 0;
+	memreg.guest_phys_addr = CHAN_ADDR;
+	memreg.memory_size = CHAN_SIZE;
+	memreg.userspace_addr = (unsigned long)ch->mem;
+	if (ioctl(vm->fd, KVM_SET_USER_MEMORY_REGION, &memreg) < 0) {
+		perror("KVM_SET_USER_MEMORY_REGION channel");
+		exit(1);
+	}
+
+	memset(&ioev, 0, sizeof(ioev));
+	ioev.addr = CHAN_DOORBELL;
+	ioev.len = 4;
+	ioev.fd = ch->doorbell[end];
+	ioev.flags = KVM_IOEVENTFD_FLAG_PIO;
+	if (ioctl(vm->fd, KVM_IOEVENTFD, &ioev) < 0)
+		perror("KVM_IOEVENTFD, doorbell will exit to host"); // run loop rings it then.
+}
+
+void chan_doorbell(struct vm *vm) {
+	uint64_t one = 1;
+	if (write(vm->chan->doorbell[vm->chan_role - 1], &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write doorbell");
+}
+
+// waits up to ms for eventfd to be signalled and returns (and resets) its count, 0 on timeout or kick.
+uint64_t eventfd_wait(int fd, int ms) {
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+	uint64_t count = 0;
+
+	if (poll(&pfd, 1, ms) <= 0 || read(fd, &count, sizeof(count)) < 0) count = 0;
+	return count;
+}
+
+// IN which waits up to ms for an eventfd (CHAN_WAIT, BLK_WAIT) without waiting in poll() on the worker. sets *count to the
+// eventfd's count (0 after ms) and returns 1, or returns 0 if guest has to be parked, vm->io.until is set then.
+int eventfd_park(struct vm *vm, struct vcpu *vcpu, int fd, int ms, uint64_t *count) {
+	uint64_t n = eventfd_wait(fd, 0), now = now_ns();
+
+	if (n == 0 && vcpu->wait_deadline == 0) vcpu->wait_deadline = now + ms * 1000000ull;
+	if (n == 0 && now < vcpu->wait_deadline) {
+		vm->io.until = now + WAIT_PARK_NS < vcpu->wait_deadline ? now + WAIT_PARK_NS : vcpu->wait_deadline;
+		return 0;
+	}
+	vcpu->wait_deadline = 0;
+	vm->io.until = 0;
+	*count = n;
+	return 1;
+}
+
+// sets *count to doorbells rung by peer since last wait and returns 1. returns 0 if guest has to be parked.
+int chan_wait(struct vm *vm, struct vcpu *vcpu, uint32_t *count) {
+	uint64_t n;
+
+	if (!eventfd_park(vm, vcpu, vm->chan->doorbell[2 - vm->chan_role], CHAN_WAIT_MS, &n)) return 0;
+	vm->stats.chan_waits++;
+	if (n == 0) vm->stats.chan_timeouts++;
+	*count = n;
+	return 1;
+}
+
+//////////////////////////////////////// Block device ////////////////////////////////////////
+// guest disk (-d image, or "disk=image" in manifest) without a hypercall per request: guest puts requests in its struct blk_queue
+// (one per VM, every VM has one vcpu) and kicks BLK_KICK, which is an ioeventfd on blk_kick_fd shared by all VMs. one I/O thread
+// wakes up on it and serves every registered queue: runs of requests with the same op on consecutive sectors are merged into one
+// preadv/pwritev, and the whole batch is completed with one store to used and one signal on the VM's done eventfd (guest waits on it
+// with IN on BLK_WAIT, parked like CHAN_WAIT so the worker runs other guests meanwhile). image is opened with O_DIRECT so guest I/O does not go through host page cache (twice cached otherwise),
+// file systems without O_DIRECT (tmpfs) fall back to buffered I/O.
+#define BLK_WAIT_MS 1
+
+struct blk_dev {
+	int fd;
+	int direct;		// fd is O_DIRECT.
+	uint64_t sectors;
+	uint64_t queue_gpa;	// 0 until guest registers its queue.
+	uint32_t used;		// host copy of queue used, guest can not move it.
+	int done_fd;		// eventfd signalled after every batch.
+};
+
+int blk_kick_fd = -1;
+pthread_mutex_t blk_lock = PTHREAD_MUTEX_INITIALIZER;	// protects blk_vms, I/O thread holds it while serving queues.
+struct vm **blk_vms;	// VMs with registered queue.
+int blk_nr_vms;
+
+// serves run of requests from slot i (mod BLK_QUEUE_SIZE) which can be done with one syscall, returns first slot not served.
+uint32_t blk_serve_run(struct vm *vm, struct blk_queue *q, uint32_t i, uint32_t avail) {
+	struct blk_dev *dev = vm->blk;
+	struct iovec iov[BLK_QUEUE_SIZE];
+	struct blk_req first = q->req[i % BLK_QUEUE_SIZE]; // copy, guest may change the slot under us.
+	uint64_t sector = first.sector, len = 0;
+	uint32_t j;
+	int n = 0;
+
+	if (first.op == BLK_FLUSH) {
+		q->req[i % BLK_QUEUE_SIZE].status = fdatasync(dev->fd) == 0 ? BLK_S_OK : BLK_S_IOERR;
+		vm->stats.blk_syscalls++;
+		return i + 1;
+	}
+	for (j = i; j != avail; j++, n++) {
+		struct blk_req r = q->req[j % BLK_QUEUE_SIZE];
+		uint64_t bytes = (uint64_t)r.nr_sectors * BLK_SECTOR;
+		char *buf = guest_phys(vm, r.buf, bytes);
+		if (r.op != first.op || r.sector != sector + len / BLK_SECTOR) break;
+		if ((r.op != BLK_READ && r.op != BLK_WRITE) || buf == NULL || r.nr_sectors == 0
+		    || r.sector + r.nr_sectors > dev->sectors || (dev->direct && r.buf % BLK_SECTOR != 0)) {
+			if (n > 0) break; // serve what is merged so far, this one is failed on next call.
+			q->req[j % BLK_QUEUE_SIZE].status = (r.op == BLK_READ || r.op == BLK_WRITE) ? BLK_S_IOERR : BLK_S_UNSUPP;
+			return j + 1;
+		}
+		iov[n].iov_base = buf;
+		iov[n].iov_len = bytes;
+		len += bytes;
+	}
+
+	ssize_t done = first.op == BLK_READ ? preadv(dev->fd, iov, n, sector * BLK_SECTOR) : pwritev(dev->fd, iov, n, sector * BLK_SECTOR);
+	vm->stats.blk_syscalls++;
+	for (int k = 0; k < n; k++) { // requests fully transferred are ok.
+		done -= iov[k].iov_len;
+		q->req[(i + k) % BLK_QUEUE_SIZE].status = done >= 0 ? BLK_S_OK : BLK_S_IOERR;
+	}
+	return j;
+}
+
+void blk_serve(struct vm *vm) {
+	struct blk_dev *dev = vm->blk;
+	struct blk_queue *q = (struct blk_queue *) guest_phys(vm, dev->queue_gpa, sizeof(struct blk_queue));
+	uint32_t avail = __atomic_load_n(&q->avail, __ATOMIC_ACQUIRE);
+	uint64_t one = 1;
+
+	if (avail == dev->used) return;
+	if (avail - dev->used > BLK_QUEUE_SIZE) { // guest overran the queue, serve only what fits.
+		printf("Host: VM %d block queue overrun\n", vm->id);
+		avail = dev->used + BLK_QUEUE_SIZE;
+	}
+	for (uint32_t i = dev->used; i != avail; )
+		i = blk_serve_run(vm, q, i, avail);
+	vm->stats.blk_reqs += avail - dev->used;
+	vm->stats.blk_batches++;
+	dev->used = avail;
+	__atomic_store_n(&q->used, avail, __ATOMIC_RELEASE);
+	if (write(dev->done_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write blk done");
+}
+
+void *blk_io_thread(void *arg) {
+	(void)arg;
+	for (;;) {
+		eventfd_wait(blk_kick_fd, -1); // kicks which came while we were serving leave it readable, none is lost.
+		pthread_mutex_lock(&blk_lock);
+		for (int i = 0; i < blk_nr_vms; i++)
+			blk_serve(blk_vms[i]);
+		pthread_mutex_unlock(&blk_lock);
+	}
+	return NULL;
+}
+
+void blk_open(struct vm *vm, const char *path) {
+	struct kvm_ioeventfd ioev;
+	struct blk_dev *dev = calloc(1, sizeof(struct blk_dev));
+	pthread_t io_thread;
+
+	dev->direct = 1;
+	dev->fd = open(path, O_RDWR | O_DIRECT);
+	if (dev->fd < 0 && errno == EINVAL) {
+		dev->direct = 0;
+		dev->fd = open(path, O_RDWR);
+	}
+	if (dev->fd < 0) {
+		perror(path);
+		exit(1);
+	}
+	dev->sectors = lseek(dev->fd, 0, SEEK_END) / BLK_SECTOR;
+	dev->done_fd = eventfd(0, EFD_NONBLOCK);
+	if (dev->done_fd < 0) {
+		perror("eventfd");
+		exit(1);
+	}
+	vm->blk = dev;
+	printf("Guest disk %s: %lu sectors%s\n", path, dev->sectors, dev->direct ? "" : ", no O_DIRECT");
+
+	if (blk_kick_fd < 0) { // first disk, start the I/O thread.
+		blk_kick_fd = eventfd(0, EFD_NONBLOCK);
+		if (blk_kick_fd < 0) {
+			perror("eventfd");
+			exit(1);
+		}
+		if (pthread_create(&io_thread, NULL, blk_io_thread, NULL) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+		pthread_detach(io_thread);
+	}
+	memset(&ioev, 0, sizeof(ioev));
+	ioev.addr = BLK_KICK;
+	ioev.len = 4;
+	ioev.fd = blk_kick_fd;
+	ioev.flags = KVM_IOEVENTFD_FLAG_PIO;
+	if (ioctl(vm->fd, KVM_IOEVENTFD, &ioev) < 0)
+		perror("KVM_IOEVENTFD, block kick will exit to host"); // run loop kicks then.
+}
+
+void blk_kick() {
+	uint64_t one = 1;
+	if (write(blk_kick_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+		perror("write blk kick");
+}
+
+void blk_detach(struct vm *vm) { // guest halted, stop serving its queue.
+	pthread_mutex_lock(&blk_lock);
+	for (int i = 0; i < blk_nr_vms; i++) {
+		if (blk_vms[i] == vm) {
+			blk_vms[i] = blk_vms[--blk_nr_vms];
+			break;
+		}
+	}
+	vm->blk->queue_gpa = 0;
+	pthread_mutex_unlock(&blk_lock);
+}
+
+int handle_blk_register(struct vm *vm, uint32_t gpa) {
+	struct blk_dev *dev = vm->blk;
+	struct blk_queue *q = (struct blk_queue *) guest_phys(vm, gpa, sizeof(struct blk_queue));
+
+	if (q == NULL || gpa == 0) {
+		printf("Host: Invalid Block Queue Memory Location\n");
+		return FALSE;
+	}
+	if (dev == NULL) { // no disk, guest sees 0 sectors.
+		q->sectors = 0;
+		return TRUE;
+	}
+	blk_detach(vm); // queue may be registered again (moved).
+	pthread_mutex_lock(&blk_lock);
+	dev->queue_gpa = gpa;
+	dev->used = q->avail;
+	q->used = q->avail;
+	q->sectors = dev->sectors;
+	blk_vms = realloc(blk_vms, (blk_nr_vms + 1) * sizeof(struct vm *));
+	blk_vms[blk_nr_vms++] = vm;
+	pthread_mutex_unlock(&blk_lock);
+	return TRUE;
+}
+
+// sets *count to batches completed since last wait and returns 1. returns 0 if guest has to be parked.
+int blk_wait(struct vm *vm, struct vcpu *vcpu, uint32_t *count) {
+	uint64_t n = 0;
+
+	if (vm->blk != NULL && !eventfd_park(vm, vcpu, vm->blk->done_fd, BLK_WAIT_MS, &n)) return 0;
+	*count = n;
+	return 1;
+}
+
+//////////////////////////////////////// Lazy restore ////////////////////////////////////////
+// -U order_file: guest image is not copied into RAM before the first KVM_RUN. RAM is registered with userfaultfd and a handler
+// thread per VM fills a page when vcpu (or host) touches it for the first time, from the image or with zeros, so load time does
+// not grow with image size. without order_file the handler records pages in order of first fault and it is written at the end;
+// with it the handler prefetches pages in that order while no fault is waiting, guest finds most of its working set in place.
+// the file has an order per image (keyed by length and first page), so guests of different modes (-t, -m) each get their own. an
+// image without one is recorded and added to the file, delete it to record all again. a page dropped after it was
+// served (balloon, reset) faults again and gets zeros, as an anonymous page would. vm_snapshot() needs all of image in RAM and
+// fills what is missing first.
+#define LAZY_PREFETCH_BATCH 16	// pages prefetched between two polls for faults.
+
+struct lazy_image {
+	int uffd;
+	int stop_fd;		// eventfd, handler returns when it is signalled.
+	pthread_t thread;
+	const unsigned char *img;
+	size_t len;
+	unsigned char *served;	// per page of RAM, 1 once handler filled it.
+	uint32_t *order;	// pages in order of first fault, when recording.
+	int nr_order;
+	const uint32_t *prefetch;	// order of this image from lazy_path, NULL if recording.
+	int nr_prefetch;
+	int prefetch_next;	// index in prefetch.
+	struct lazy_order *lo;
+};
+
+struct lazy_order_hdr {	// one per image in the file, page numbers follow each.
+	char magic[8];
+	uint64_t image_len;
+	uint64_t image_hash;	// page_hash() of first page of image.
+	uint32_t nr;		// page numbers (uint32_t) after header.
+	uint32_t pad;
+};
+
+struct lazy_order {	// fault order of an image, read from lazy_path or recorded by first VM of the image which finished.
+	uint64_t image_len;
+	uint64_t image_hash;
+	uint32_t *pages;	// NULL while recording.
+	int nr;
+	struct lazy_order *next;
+};
+
+const char *lazy_path;
+struct lazy_order *lazy_orders;	// head of list.
+int lazy_orders_read;
+pthread_mutex_t lazy_lock = PTHREAD_MUTEX_INITIALIZER;	// protects lazy_orders, one VM per image records.
+
+uint64_t lazy_image_hash(const unsigned char *img, size_t len) {
+	char page[PAGE_SIZE] = { 0 };
+	memcpy(page, img, len < PAGE_SIZE ? len : PAGE_SIZE);
+	return page_hash(page);
+}
+
+struct lazy_order *lazy_order_add(uint64_t image_len, uint64_t image_hash) {
+	struct lazy_order *lo = calloc(1, sizeof(struct lazy_order));
+	lo->image_len = image_len;
+	lo->image_hash = image_hash;
+	lo->next = lazy_orders;
+	lazy_orders = lo;
+	return lo;
+}
+
+// reads the orders of all images in the file. an order longer than guest RAM has pages is not of this guest (or file is
+// corrupt), the file is not used then and is written again.
+void lazy_read_orders(size_t pages) {
+	struct lazy_order_hdr hdr;
+	FILE *fp = fopen(lazy_path, "r");
+
+	lazy_orders_read = 1;
+	if (fp == NULL) return;
+	while (fread(&hdr, sizeof(hdr), 1, fp) == 1) {
+		if (memcmp(hdr.magic, "KVMHLAZY", 8) != 0 || hdr.nr > pages) {
+			fprintf(stderr, "%s: not a fault order of this guest, recording again\n", lazy_path);
+			break;
+		}
+		struct lazy_order *lo = lazy_order_add(hdr.image_len, hdr.image_hash);
+		lo->pages = malloc(hdr.nr * sizeof(uint32_t) + 1);
+		lo->nr = fread(lo->pages, sizeof(uint32_t), hdr.nr, fp);
+	}
+	fclose(fp);
+}
+
+void lazy_write_orders(struct lazy_order *recorded) { // every image which has an order, the one just recorded included.
+	char tmp[PATH_MAX];
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", lazy_path);
+	fp = fopen(tmp, "w");
+	for (struct lazy_order *lo = lazy_orders; fp != NULL && lo != NULL; lo = lo->next) {
+		struct lazy_order_hdr hdr = { .image_len = lo->image_len, .image_hash = lo->image_hash, .nr = lo->nr };
+		if (lo->pages == NULL) continue;
+		memcpy(hdr.magic, "KVMHLAZY", 8);
+		if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 || fwrite(lo->pages, sizeof(uint32_t), lo->nr, fp) != (size_t)lo->nr) {
+			fclose(fp);
+			fp = NULL;
+		}
+	}
+	if (fp == NULL || fclose(fp) != 0 || rename(tmp, lazy_path) < 0) {
+		perror(lazy_path);
+		return;
+	}
+	printf("Host: fault order of %d pages written to %s\n", recorded->nr, lazy_path);
+}
+
+// fills missing page of RAM, returns 1 if it came from image.
+int lazy_serve(struct vm *vm, size_t page) {
+	struct lazy_image *lz = vm->lazy;
+	char *hva = vm->mem + page * PAGE_SIZE;
+	size_t off = page * PAGE_SIZE;
+	int from_image = !lz->served[page] && off < lz->len;
+	int ret;
+
+	if (from_image) {
+		char bounce[PAGE_SIZE] = { 0 };
+		const void *src = lz->img + off;
+		if (lz->len - off < PAGE_SIZE) { // last page of image.
+			memcpy(bounce, src, lz->len - off);
+			src = bounce;
+		}
+		struct uffdio_copy copy = { .dst = (uintptr_t)hva, .src = (uintptr_t)src, .len = PAGE_SIZE };
+		ret = ioctl(lz->uffd, UFFDIO_COPY, &copy);
+	} else {
+		struct uffdio_zeropage zero = { .range = { .start = (uintptr_t)hva, .len = PAGE_SIZE } };
+		ret = ioctl(lz->uffd, UFFDIO_ZEROPAGE, &zero);
+	}
+	if (ret < 0 && errno == EEXIST) { // filled meanwhile (prefetch, lazy_fill()), faulting thread still has to be woken.
+		struct uffdio_range range = { .start = (uintptr_t)hva, .len = PAGE_SIZE };
+		ret = ioctl(lz->uffd, UFFDIO_WAKE, &range);
+	}
+	if (ret < 0) {
+		perror("userfaultfd fill");
+		exit(1); // faulting thread would wait forever.
+	}
+	lz->served[page] = 1;
+	return from_image;
+}
+
+void *lazy_handler(void *arg) {
+	struct vm *vm = arg;
+	struct lazy_image *lz = vm->lazy;
+	struct pollfd pfd[2] = { { .fd = lz->uffd, .events = POLLIN }, { .fd = lz->stop_fd, .events = POLLIN } };
+	size_t pages = vm->mem_size / PAGE_SIZE;
+
+	for (;;) {
+		int prefetching = lz->prefetch_next < lz->nr_prefetch;
+		if (poll(pfd, 2, prefetching ? 0 : -1) < 0) {
+			if (errno == EINTR) continue;
+			perror("poll userfaultfd");
+			exit(1);
+		}
+		if (pfd[1].revents & POLLIN) return NULL;
+		if (pfd[0].revents & POLLIN) {
+			struct uffd_msg msg[16];
+			ssize_t n = read(lz->uffd, msg, sizeof(msg));
+			if (n < 0 && errno == EAGAIN) continue;
+			if (n < 0) {
+				perror("read userfaultfd");
+				exit(1);
+			}
+			for (size_t i = 0; i < n / sizeof(struct uffd_msg); i++) {
+				if (msg[i].event != UFFD_EVENT_PAGEFAULT) continue;
+				uint64_t t = now_ns();
+				size_t page = (msg[i].arg.pagefault.address - (uintptr_t)vm->mem) / PAGE_SIZE;
+				if (lz->prefetch == NULL && !lz->served[page]) lz->order[lz->nr_order++] = page;
+				vm->stats.lazy_image_faults += lazy_serve(vm, page);
+				vm->stats.lazy_faults++;
+				vm->stats.lazy_fault_ns += now_ns() - t;
+			}
+			continue;
+		}
+		for (int i = 0; i < LAZY_PREFETCH_BATCH && lz->prefetch_next < lz->nr_prefetch; i++) { // no fault is waiting.
+			uint32_t page = lz->prefetch[lz->prefetch_next++];
+			if (page >= pages || lz->served[page]) continue;
+			lazy_serve(vm, page);
+			vm->stats.lazy_prefetched++;
+		}
+	}
+}
+
+// loads guest image at guest physical 0, lazily with -U. returns when guest can run.
+void guest_image_load(struct vm *vm, const unsigned char *img, size_t len) {
+	struct lazy_image *lz;
+	struct uffdio_api api = { .api = UFFD_API };
+	struct uffdio_register reg = { .range = { .start = (uintptr_t)vm->mem, .len = vm->mem_size }, .mode = UFFDIO_REGISTER_MODE_MISSING };
+
+	if (lazy_path == NULL || vm->lazy != NULL) { // loaded again on a reused VM, its pages are there now.
+		memcpy(vm->mem, img, len);
+		return;
+	}
+	lz = calloc(1, sizeof(struct lazy_image));
+	lz->uffd = syscall(SYS_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+	if (lz->uffd < 0 || ioctl(lz->uffd, UFFDIO_API, &api) < 0 || ioctl(lz->uffd, UFFDIO_REGISTER, &reg) < 0) {
+		perror("userfaultfd, guest image is copied");
+		if (lz->uffd >= 0) close(lz->uffd);
+		free(lz);
+		memcpy(vm->mem, img, len);
+		return;
+	}
+	lz->stop_fd = eventfd(0, EFD_CLOEXEC);
+	lz->img = img;
+	lz->len = len;
+	lz->served = calloc(vm->mem_size / PAGE_SIZE, 1);
+	lz->order = malloc(vm->mem_size / PAGE_SIZE * sizeof(uint32_t));
+	vm->lazy = lz;
+	uint64_t hash = lazy_image_hash(img, len);
+	pthread_mutex_lock(&lazy_lock);
+	if (!lazy_orders_read) lazy_read_orders(vm->mem_size / PAGE_SIZE);
+	for (lz->lo = lazy_orders; lz->lo != NULL; lz->lo = lz->lo->next)
+		if (lz->lo->image_len == len && lz->lo->image_hash == hash) break;
+	if (lz->lo == NULL) lz->lo = lazy_order_add(len, hash);
+	lz->prefetch = lz->lo->pages;
+	lz->nr_prefetch = lz->lo->nr;
+	pthread_mutex_unlock(&lazy_lock);
+	if (pthread_create(&lz->thread, NULL, lazy_handler, vm) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+}
+
+void lazy_fill(struct vm *vm) { // rest of image into RAM now.
+	struct lazy_image *lz = vm->lazy;
+	for (size_t page = 0; page * PAGE_SIZE < lz->len; page++)
+		if (!lz->served[page]) lazy_serve(vm, page);
+}
+
+// guest is done: RAM goes back to normal anonymous memory, handler stops, first VM of an image which recorded adds its order to the file.
+void lazy_finish(struct vm *vm) {
+	struct lazy_image *lz = vm->lazy;
+	struct uffdio_range range = { .start = (uintptr_t)vm->mem, .len = vm->mem_size };
+	uint64_t one = 1;
+
+	if (lz == NULL || lz->stop_fd < 0) return;
+	if (ioctl(lz->uffd, UFFDIO_UNREGISTER, &range) < 0) perror("UFFDIO_UNREGISTER");
+	if (write(lz->stop_fd, &one, sizeof(one)) != sizeof(one)) perror("write lazy stop");
+	pthread_join(lz->thread, NULL);
+	close(lz->stop_fd);
+	close(lz->uffd);
+	lz->stop_fd = -1;
+	pthread_mutex_lock(&lazy_lock);
+	if (lz->prefetch == NULL && lz->lo->pages == NULL) {
+		lz->lo->pages = lz->order;
+		lz->lo->nr = lz->nr_order;
+		lazy_write_orders(lz->lo);
+	}
+	pthread_mutex_unlock(&lazy_lock);
+}
+
+void print_lazy_stats(struct vm *vm) {
+	struct vm_stats *st = &vm->stats;
+	if (vm->lazy == NULL) return;
+	printf("VM %d: lazy restore served %lu faults (%lu from image, %lu us each), prefetched %lu pages\n", vm->id, st->lazy_faults,
+	       st->lazy_image_faults, st->lazy_faults ? st->lazy_fault_ns / st->lazy_faults / 1000 : 0, st->lazy_prefetched);
+}
+
+//////////////////////////////////////// Reset ////////////////////////////////////////
+// -n runs runs the same guest again and again in the same VM: no new /dev/kvm VM, VCPU or RAM mmap, only the state guest changed
+// is put back. vm_snapshot() is taken after the guest is loaded: registers and the pages which are not zero (guest image, page
+// tables). vm_reset() sets the registers again, copies the pristine pages back and drops every other page which is resident,
+// anonymous memory becomes resident only when guest (or host on its behalf) touches it, so that is exactly what was dirtied.
+// (KVM dirty log is not enough, host writes guest memory from userspace on hypercalls and from the I/O thread.)
+// dropped pages (MADV_DONTNEED, also the ones balloon had only MADV_FREE'd) come back zero filled on next touch. host side state of the guest (open files, disk queue) is released.
+// channel memory is shared with the peer and is not reset.
+struct vm_snapshot {
+	struct kvm_regs regs;
+	struct kvm_sregs sregs;
+	struct kvm_fpu fpu;		// without XSAVE,
+	struct kvm_xsave *xsave;	// with it, x87/SSE/AVX state and XCR0.
+	struct kvm_xcrs xcrs;
+	struct kvm_lapic_state lapic;	// with irqchip.
+	uint64_t apic_base;
+	unsigned char *pristine;	// one byte per page of RAM, 1 if page is in data.
+	uint64_t *gpa;			// pristine pages,
+	char *data;			// and their content.
+	int nr_pages;
+};
+
+int vm_runs = 1;	// times every guest is run, VM is reset between runs.
+
+void vm_snapshot(struct vm *vm, struct vcpu *vcpu) { // call when guest is loaded and did not run yet.
+	struct vm_snapshot *snap = calloc(1, sizeof(struct vm_snapshot));
+	size_t pages = vm->mem_size / PAGE_SIZE;
+	if (vm->lazy != NULL) lazy_fill(vm); // pages which are not resident are taken as zero.
+	unsigned char *vec = vm_mincore(vm);
+
+	if (ioctl(vcpu->fd, KVM_GET_REGS, &snap->regs) < 0 || ioctl(vcpu->fd, KVM_GET_SREGS, &snap->sregs) < 0
+	    || ioctl(vcpu->fd, KVM_GET_FPU, &snap->fpu) < 0) {
+		perror("snapshot registers");
+		exit(1);
+	}
+	if (vm->xcr0) {
+		snap->xsave = calloc(1, sizeof(struct kvm_xsave));
+		if (ioctl(vcpu->fd, KVM_GET_XSAVE, snap->xsave) < 0 || ioctl(vcpu->fd, KVM_GET_XCRS, &snap->xcrs) < 0) {
+			perror("snapshot XSAVE state");
+			exit(1);
+		}
+	}
+	if (vm->irqchip) {
+		if (ioctl(vcpu->fd, KVM_GET_LAPIC, &snap->lapic) < 0) {
+			perror("KVM_GET_LAPIC");
+			exit(1);
+		}
+		snap->apic_base = vcpu_get_msr(vcpu->fd, MSR_IA32_APICBASE);
+	}
+	snap->pristine = calloc(pages, 1);
+	for (size_t i = 0; i < pages; i++) {
+		char *page = vm->mem + i * PAGE_SIZE;
+		if (vec != NULL && !(vec[i] & 1)) continue; // never touched, zero.
+		if (page_is_zero(page)) continue;
+		snap->gpa = realloc(snap->gpa, (snap->nr_pages + 1) * sizeof(uint64_t));
+		snap->data = realloc(snap->data, (snap->nr_pages + 1) * PAGE_SIZE);
+		snap->gpa[snap->nr_pages] = i * PAGE_SIZE;
+		memcpy(snap->data + snap->nr_pages * PAGE_SIZE, page, PAGE_SIZE);
+		snap->nr_pages++;
+		snap->pristine[i] = 1;
+	}
+	vm->snap = snap;
+}
+
+void vm_reset(struct vm *vm, struct vcpu *vcpu) {
+	struct vm_snapshot *snap = vm->snap;
+	size_t pages = vm->mem_size / PAGE_SIZE;
+	dedup_unmerge(vm, 0, vm->mem_size); // before mincore, merged pages are resident memfd pages.
+	unsigned char *vec = vm_mincore(vm);
+	uint64_t t = now_ns();
+	size_t run = 0, run_len = 0;
+
+	if (ioctl(vcpu->fd, KVM_SET_SREGS, &snap->sregs) < 0 || ioctl(vcpu->fd, KVM_SET_REGS, &snap->regs) < 0
+	    || ioctl(vcpu->fd, KVM_SET_FPU, &snap->fpu) < 0) {
+		perror("reset registers");
+		exit(1);
+	}
+	if (snap->xsave != NULL) { // XCR0 first, XSAVE area is checked against it.
+		if (ioctl(vcpu->fd, KVM_SET_XCRS, &snap->xcrs) < 0 || ioctl(vcpu->fd, KVM_SET_XSAVE, snap->xsave) < 0) {
+			perror("reset XSAVE state");
+			exit(1);
+		}
+	}
+	if (vm->irqchip) { // back to xAPIC mode first, LAPIC state of snapshot is an xAPIC one. timer is disarmed.
+		vcpu_set_msr(vcpu->fd, MSR_IA32_APICBASE, snap->apic_base);
+		if (ioctl(vcpu->fd, KVM_SET_LAPIC, &snap->lapic) < 0) {
+			perror("KVM_SET_LAPIC");
+			exit(1);
+		}
+		vcpu_set_msr(vcpu->fd, MSR_IA32_TSC_DEADLINE, 0);
+	}
+
+	for (size_t i = 0; i <= pages; i++) { // drop runs of touched pages which were zero, i == pages ends the last run.
+		if (i < pages && !snap->pristine[i] && (vec == NULL || (vec[i] & 1))) {
+			if (run_len++ == 0) run = i;
+			continue;
+		}
+		if (run_len == 0) continue;
+		if (madvise(vm->mem + run * PAGE_SIZE, run_len * PAGE_SIZE, MADV_DONTNEED) < 0)
+			perror("madvise reset");
+		vm->stats.reset_dropped += run_len;
+		run_len = 0;
+	}
+	for (int i = 0; i < snap->nr_pages; i++)
+		memcpy(vm->mem + snap->gpa[i], snap->data + i * PAGE_SIZE, PAGE_SIZE);
+	vm->stats.reset_copied += snap->nr_pages;
+
+	if (vm->file != NULL) fs_release(vm); // guest did not halt (normally released on HLT).
+	if (vm->blk != NULL) blk_detach(vm);
+	vm->balloon_target = 0;
+	if (vm->dedup != NULL) vm->dedup->full = 1; // pages copied back are not in the dirty log.
+	__atomic_store_n(&vm->metrics_gpa, 0, __ATOMIC_RELEASE); // guest registers its page again.
+	memset(&vcpu->mmu, 0, sizeof(vcpu->mmu));
+	vcpu->started = 0;
+	vcpu->io_pending = 0;
+	vcpu->wait_deadline = 0;
+	vm->io.until = 0;
+	vcpu->kvm_run->immediate_exit = 0;
+	vm->io_exits_base = vm->stats.io_exits;
+	vm->stats.resets++;
+	vm->stats.reset_ns += now_ns() - t;
+}
+
+static inline void account_faults(struct vm *vm) {
+	struct rusage ru;
+	getrusage(RUSAGE_THREAD, &ru);
+	vm->stats.minflt += ru.ru_minflt;
+	vm->stats.majflt += ru.ru_majflt;
+}
+
+//////////////////////////////////////// Crash dumps ////////////////////////////////////////
+// an exit host can not handle (KVM_EXIT_SHUTDOWN on triple fault, INTERNAL_ERROR, FAIL_ENTRY, an unknown exit or an I/O port
+// nobody serves) stops only that guest: its run loop returns VCPU_CRASHED and the other guests keep running. the vcpu thread
+// writes struct crash_hdr (regs, sregs, what kvm_run says about the exit, see kvm-header.h) to <-C dir>/vm<id>-<pid>.core and
+// leaves guest RAM to a dump thread, which writes only non-zero pages so the file is sparse. guest never runs again so its RAM
+// does not change under the thread, and the thread finishes the VM's lazy restore (see lazy_finish()) after it so pages not
+// restored yet are read from the image. "./kvm-dump file" prints a dump. without -C the guest is only stopped, a dump is as big
+// as guest RAM and is not written anywhere unasked.
+struct crash_dump {
+	struct vm *vm;
+	int fd;
+	struct crash_hdr hdr;
+	char path[PATH_MAX];
+	pthread_t thread;
+	struct crash_dump *next;
+};
+
+const char *crash_dir;	// -C, NULL = no dumps.
+pthread_mutex_t crash_lock = PTHREAD_MUTEX_INITIALIZER;
+struct crash_dump *crash_dumps;	// dumps started, joined by crash_wait().
+
+void *crash_writer(void *arg) {
+	struct crash_dump *cd = arg;
+	struct vm *vm = cd->vm;
+
+	for (size_t off = 0; off < vm->mem_size; off += PAGE_SIZE) {
+		if (page_is_zero(vm->mem + off)) continue;
+		if (pwrite(cd->fd, vm->mem + off, PAGE_SIZE, CRASH_DATA_OFFSET + off) != PAGE_SIZE) {
+			perror(cd->path);
+			break;
+		}
+		cd->hdr.pages++;
+	}
+	if (ftruncate(cd->fd, CRASH_DATA_OFFSET + vm->mem_size) < 0 // zero pages at the end are holes too.
+	    || pwrite(cd->fd, &cd->hdr, sizeof(cd->hdr), 0) != sizeof(cd->hdr))
+		perror(cd->path);
+	close(cd->fd);
+	printf("Host: crash dump of VM %d written to %s, %lu of %lu pages\n", vm->id, cd->path, cd->hdr.pages, vm->mem_size / PAGE_SIZE);
+	lazy_finish(vm);
+	return NULL;
+}
+
+void crash_dump(struct vm *vm, struct vcpu *vcpu) {
+	struct kvm_run *run = vcpu->kvm_run;
+	struct crash_dump *cd = calloc(1, sizeof(struct crash_dump));
+	struct crash_hdr *h = &cd->hdr;
+	struct timespec ts;
+
+	fprintf(stderr, "VM %d: got exit_reason %d, expected KVM_EXIT_HLT (%d), guest is stopped%s\n", vm->id, run->exit_reason,
+		KVM_EXIT_HLT, crash_dir == NULL ? " (-C dir writes a crash dump)" : "");
+	if (crash_dir == NULL) {
+		free(cd);
+		lazy_finish(vm);
+		return;
+	}
+	cd->vm = vm;
+	memcpy(h->magic, CRASH_MAGIC, sizeof(h->magic));
+	h->version = CRASH_VERSION;
+	h->exit_reason = run->exit_reason;
+	h->vm_id = vm->id;
+	h->mem_size = vm->mem_size;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->time_ns = ts.tv_sec * 1000000000ull + ts.tv_nsec;
+	h->exits = vm->stats.exits;
+	if (run->exit_reason == KVM_EXIT_INTERNAL_ERROR) {
+		h->info[h->ninfo++] = run->internal.suberror;
+		for (uint32_t i = 0; i < run->internal.ndata && h->ninfo < CRASH_INFO_MAX; i++)
+			h->info[h->ninfo++] = run->internal.data[i];
+	} else if (run->exit_reason == KVM_EXIT_FAIL_ENTRY) {
+		h->info[0] = run->fail_entry.hardware_entry_failure_reason;
+		h->info[1] = run->fail_entry.cpu;
+		h->ninfo = 2;
+	} else if (run->exit_reason == KVM_EXIT_IO) {
+		h->info[0] = run->io.direction;
+		h->info[1] = run->io.size;
+		h->info[2] = run->io.port;
+		h->info[3] = run->io.count;
+		h->ninfo = 4;
+	}
+	if (ioctl(vcpu->fd, KVM_GET_REGS, &h->regs) < 0) perror("KVM_GET_REGS");
+	if (ioctl(vcpu->fd, KVM_GET_SREGS, &h->sregs) < 0) perror("KVM_GET_SREGS");
+
+	snprintf(cd->path, sizeof(cd->path), "%s/vm%d-%d.core", crash_dir, vm->id, getpid());
+	cd->fd = open(cd->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (cd->fd < 0 || pwrite(cd->fd, h, sizeof(*h), 0) != sizeof(*h)) { // header without pages first, a dump cut short says so.
+		perror(cd->path);
+		if (cd->fd >= 0) close(cd->fd);
+		free(cd);
+		lazy_finish(vm);
+		return;
+	}
+	if (pthread_create(&cd->thread, NULL, crash_writer, cd) != 0) {
+		perror("pthread_create");
+		crash_writer(cd);
+		free(cd);
+		return;
+	}
+	pthread_mutex_lock(&crash_lock);
+	cd->next = crash_dumps;
+	crash_dumps = cd;
+	pthread_mutex_unlock(&crash_lock);
+}
+
+void crash_wait() { // waits for dumps being written.
+	pthread_mutex_lock(&crash_lock);
+	while (crash_dumps != NULL) {
+		struct crash_dump *cd = crash_dumps;
+		crash_dumps = cd->next;
+		pthread_join(cd->thread, NULL);
+		free(cd);
+	}
+	pthread_mutex_unlock(&crash_lock);
+}
+
+//////////////////////////////////////// Metrics ////////////////////////////////////////
+// -E file: a thread rewrites file every METRICS_INTERVAL_MS (and once more when guests are done) in Prometheus text format, with
+// host stats of every VM and the metrics guest keeps in its struct metrics_page (METRICS_PORT). file is written next to itself and
+// renamed so a reader (node_exporter textfile collector, a script) never sees half of it. guest metrics are read from guest RAM
+// while the guest runs, host stats without locks, so values may be a little behind but guest pays no exit for any of them.
+#define METRICS_INTERVAL_MS 1000
+
+char *metrics_path;
+pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;	// protects metrics_vms and metrics_stop.
+pthread_cond_t metrics_cond = PTHREAD_COND_INITIALIZER;
+struct vm **metrics_vms;
+int metrics_nr_vms;
+int metrics_stop;
+
+struct host_metric {
+	const char *name;
+	size_t offset;		// in struct vm_stats.
+};
+
+struct host_metric host_metrics[] = {
+	{ "exits_total", offsetof(struct vm_stats, exits) },
+	{ "io_exits_total", offsetof(struct vm_stats, io_exits) },
+	{ "fs_ops_total", offsetof(struct vm_stats, fs_ops) },
+	{ "balloon_ops_total", offsetof(struct vm_stats, balloon_ops) },
+	{ "chan_waits_total", offsetof(struct vm_stats, chan_waits) },
+	{ "blk_requests_total", offsetof(struct vm_stats, blk_reqs) },
+	{ "blk_syscalls_total", offsetof(struct vm_stats, blk_syscalls) },
+	{ "resets_total", offsetof(struct vm_stats, resets) },
+	{ "throttled_total", offsetof(struct vm_stats, throttled) },
+	{ "fair_queue_waits_total", offsetof(struct vm_stats, fq_waits) },
+	{ "dedup_scans_total", offsetof(struct vm_stats, dedup_scans) },
+	{ "dedup_hashed_pages_total", offsetof(struct vm_stats, dedup_hashed) },
+	{ "minor_faults_total", offsetof(struct vm_stats, minflt) },
+	{ "major_faults_total", offsetof(struct vm_stats, majflt) },
+};
+
+void metrics_add_vm(struct vm *vm) {
+	if (metrics_path == NULL) return;
+	pthread_mutex_lock(&metrics_lock);
+	metrics_vms = realloc(metrics_vms, (metrics_nr_vms + 1) * sizeof(struct vm *));
+	metrics_vms[metrics_nr_vms++] = vm;
+	pthread_mutex_unlock(&metrics_lock);
+}
+
+int handle_metrics_register(struct vm *vm, uint32_t gpa) {
+	if (guest_phys(vm, gpa, sizeof(struct metrics_page)) == NULL || gpa == 0) {
+		printf("Host: Invalid Metrics Page Memory Location\n");
+		return FALSE;
+	}
+	__atomic_store_n(&vm->metrics_gpa, gpa, __ATOMIC_RELEASE);
+	return TRUE;
+}
+
+// consistent copy of guest metrics page, FALSE if there is none or guest stayed in the middle of an update (it was preempted).
+int metrics_snapshot(struct vm *vm, struct metrics_page *copy) {
+	uint64_t gpa = __atomic_load_n(&vm->metrics_gpa, __ATOMIC_ACQUIRE);
+	struct metrics_page *page = (struct metrics_page *) guest_phys(vm, gpa, sizeof(struct metrics_page));
+
+	if (gpa == 0 || page == NULL) return FALSE;
+	for (int tries = 0; tries < 100; tries++) {
+		uint32_t seq = __atomic_load_n(&page->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1) {
+			sched_yield();
+			continue;
+		}
+		memcpy(copy, page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&page->seq, __ATOMIC_RELAXED) == seq) {
+			if (copy->nr > METRICS_MAX) copy->nr = METRICS_MAX;
+			return TRUE;
+		}
+	}
+	return FALSE;
+}
+
+int metric_name_ok(const struct metric *m) { // name goes into the file as it is.
+	if (m->name[0] == '\0' || memchr(m->name, '\0', METRICS_NAME) == NULL) return FALSE;
+	for (const char *p = m->name; *p; p++)
+		if (!((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9') || *p == '_')) return FALSE;
+	return m->type == METRIC_COUNTER || m->type == METRIC_HISTOGRAM;
+}
+
+void metrics_write_guest(FILE *fp, const struct metric *m, int vm_id) {
+	uint64_t le = 0;
+
+	if (m->type == METRIC_COUNTER) {
+		fprintf(fp, "kvm_hello_guest_%s{vm=\"%d\"} %lu\n", m->name, vm_id, m->value);
+		return;
+	}
+	for (int b = 0; b < METRICS_BUCKETS - 1; b++) { // guest buckets are not cumulative, Prometheus ones are.
+		le += m->bucket[b];
+		fprintf(fp, "kvm_hello_guest_%s_bucket{vm=\"%d\",le=\"%lu\"} %lu\n", m->name, vm_id, (1ul << b) - 1, le);
+	}
+	fprintf(fp, "kvm_hello_guest_%s_bucket{vm=\"%d\",le=\"+Inf\"} %lu\n", m->name, vm_id, m->count);
+	fprintf(fp, "kvm_hello_guest_%s_sum{vm=\"%d\"} %lu\n", m->name, vm_id, m->value);
+	fprintf(fp, "kvm_hello_guest_%s_count{vm=\"%d\"} %lu\n", m->name, vm_id, m->count);
+}
+
+void metrics_write() {
+	char tmp[PATH_MAX];
+	struct metrics_page *pages;
+	int *has_page;
+	FILE *fp;
+
+	snprintf(tmp, sizeof(tmp), "%s.tmp", metrics_path);
+	fp = fopen(tmp, "w");
+	if (fp == NULL) {
+		perror(tmp);
+		return;
+	}
+	pthread_mutex_lock(&metrics_lock);
+	pages = malloc(metrics_nr_vms * sizeof(struct metrics_page));
+	has_page = malloc(metrics_nr_vms * sizeof(int));
+	for (int i = 0; i < metrics_nr_vms; i++)
+		has_page[i] = metrics_snapshot(metrics_vms[i], &pages[i]);
+
+	for (size_t k = 0; k < sizeof(host_metrics) / sizeof(host_metrics[0]); k++) {
+		fprintf(fp, "# TYPE kvm_hello_%s counter\n", host_metrics[k].name);
+		for (int i = 0; i < metrics_nr_vms; i++)
+			fprintf(fp, "kvm_hello_%s{vm=\"%d\"} %lu\n", host_metrics[k].name, metrics_vms[i]->id,
+				*(uint64_t *)((char *)&metrics_vms[i]->stats + host_metrics[k].offset));
+	}
+	fprintf(fp, "# TYPE kvm_hello_resident_bytes gauge\n");
+	for (int i = 0; i < metrics_nr_vms; i++)
+		fprintf(fp, "kvm_hello_resident_bytes{vm=\"%d\"} %lu\n", metrics_vms[i]->id, vm_resident_pages(metrics_vms[i]) * PAGE_SIZE);
+
+	// samples of a metric have to be together, so every name is written for all VMs when it is first seen.
+	for (int i = 0; i < metrics_nr_vms; i++) {
+		for (uint32_t j = 0; has_page[i] && j < pages[i].nr; j++) {
+			struct metric *m = &pages[i].m[j];
+			int seen = !metric_name_ok(m);
+			for (int pi = 0; pi <= i && !seen; pi++)
+				for (uint32_t pj = 0; has_page[pi] && pj < (pi == i ? j : pages[pi].nr) && !seen; pj++)
+					seen = strcmp(pages[pi].m[pj].name, m->name) == 0;
+			if (seen) continue;
+			fprintf(fp, "# TYPE kvm_hello_guest_%s %s\n", m->name, m->type == METRIC_COUNTER ? "counter" : "histogram");
+			for (int vi = i; vi < metrics_nr_vms; vi++)
+				for (uint32_t vj = 0; has_page[vi] && vj < pages[vi].nr; vj++)
+					if (pages[vi].m[vj].type == m->type && strcmp(pages[vi].m[vj].name, m->name) == 0)
+						metrics_write_guest(fp, &pages[vi].m[vj], metrics_vms[vi]->id);
+		}
+	}
+	pthread_mutex_unlock(&metrics_lock);
+	free(pages);
+	free(has_page);
+
+	if (fclose(fp) != 0 || rename(tmp, metrics_path) < 0)
+		perror(metrics_path);
+}
+
+void *metrics_thread(void *arg) {
+	(void)arg;
+	pthread_mutex_lock(&metrics_lock);
+	while (!metrics_stop) {
+		struct timespec until;
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += METRICS_INTERVAL_MS / 1000;
+		until.tv_nsec += METRICS_INTERVAL_MS % 1000 * 1000000;
+		if (until.tv_nsec >= 1000000000) {
+			until.tv_sec++;
+			until.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&metrics_cond, &metrics_lock, &until);
+		if (metrics_stop) break;
+		pthread_mutex_unlock(&metrics_lock);
+		metrics_write();
+		pthread_mutex_lock(&metrics_lock);
+	}
+	pthread_mutex_unlock(&metrics_lock);
+	return NULL;
+}
+
+void metrics_start(pthread_t *thread) {
+	if (pthread_create(thread, NULL, metrics_thread, NULL) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+}
+
+void metrics_finish(pthread_t thread) { // last write has the final numbers.
+	pthread_mutex_lock(&metrics_lock);
+	metrics_stop = 1;
+	pthread_cond_signal(&metrics_cond);
+	pthread_mutex_unlock(&metrics_lock);
+	pthread_join(thread, NULL);
+	metrics_write();
+}
+
+//////////////////////////////////////// Kicks and profiler ////////////////////////////////////////
+// a vcpu thread is kicked out of KVM_RUN with a signal: SIGUSR1 to preempt the guest (end of time slice), SIGUSR2 to take a
+// profile sample. kick_handler() also sets immediate_exit, so a kick which lands while host is handling an exit makes the next
+// KVM_RUN return EINTR at once and is not lost. SA_RESTART restarts host syscalls like write(), KVM_RUN returns EINTR anyway.
+//
+// -S file samples guest stacks profile_hz (-F) times a second: RIP and then return addresses found by following the frame
+// pointer chain through guest memory (guest is built with -fno-omit-frame-pointer), symbolized with the function symbols of
+// guest32.elf / guest64.elf (the guest images linked as ELF, see Makefile). samples are written as folded stacks
+// ("vm0;_start;part_C;test_read 12"), flamegraph.pl takes them as they are.
+#define PROFILE_MAX_DEPTH 32
+
+__thread struct kvm_run *kick_run;	// vcpu this thread is running.
+__thread volatile sig_atomic_t preempt_pending, profile_pending;
+__thread uint64_t *kick_target;		// slice a preempt kick is meant for (worker's kick_slice), NULL if not a worker.
+__thread volatile uint64_t kick_slice;	// slice this thread is running.
+
+void kick_handler(int sig) {
+	// a worker may have gone on to another guest between ticker's look and the signal, that one has just started.
+	if (sig == SIGUSR1 && kick_target != NULL && __atomic_load_n(kick_target, __ATOMIC_ACQUIRE) != kick_slice) return;
+	if (sig == SIGUSR2) profile_pending = 1;
+	else preempt_pending = 1;
+	if (kick_run != NULL) kick_run->immediate_exit = 1;
+}
+
+void kick_init() {
+	struct sigaction sa;
+
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = kick_handler;
+	sa.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+}
+
+struct guest_sym {
+	uint64_t addr;
+	uint64_t size;
+	char *name;
+};
+
+struct guest_syms {
+	const char *path;
+	int loaded;
+	struct guest_sym *sym;	// sorted on addr.
+	int nr;
+};
+
+char *profile_path;
+int profile_hz = 1000;
+int profile_stop;
+struct guest_syms profile_syms[2] = { { .path = "guest32.elf" }, { .path = "guest64.elf" } };
+pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;	// protects symbols and samples, workers sample in parallel.
+
+// samples are counted per distinct stack as they come, in a hash table keyed by the raw stack. stacks are symbolized and folded
+// only when the file is written, so memory grows with distinct stacks, not with run time.
+#define PROFILE_TABLE_MIN 1024
+
+struct profile_stack {
+	uint64_t hash;		// 0 for an empty slot.
+	uint64_t count;
+	int vm_id;
+	int word;		// guest word size, picks the symbols (0 = real mode).
+	int depth;
+	uint64_t pc[PROFILE_MAX_DEPTH];	// leaf first.
+};
+
+struct profile_stack *profile_table;	// open addressing, grown when half full.
+int profile_size, profile_used;
+int profile_nr;		// samples taken.
+
+int sym_cmp(const void *a, const void *b) {
+	const struct guest_sym *x = a, *y = b;
+	return x->addr < y->addr ? -1 : x->addr > y->addr;
+}
+
+void add_guest_sym(struct guest_syms *gs, uint64_t addr, uint64_t size, const char *name) {
+	gs->sym = realloc(gs->sym, (gs->nr + 1) * sizeof(struct guest_sym));
+	gs->sym[gs->nr].addr = addr;
+	gs->sym[gs->nr].size = size;
+	gs->sym[gs->nr].name = strdup(name);
+	gs->nr++;
+}
+
+void load_guest_syms(struct guest_syms *gs) { // function symbols of 32 or 64 bit ELF, no symbols if file is missing.
+	FILE *fp = fopen(gs->path, "rb");
+	char *buf;
+	long len;
+
+	gs->loaded = 1;
+	if (fp == NULL) {
+		fprintf(stderr, "Host: no guest symbols, %s: %s\n", gs->path, strerror(errno));
+		return;
+	}
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	rewind(fp);
+	buf = malloc(len);
+	if (fread(buf, len, 1, fp) != 1 || len < EI_NIDENT || memcmp(buf, ELFMAG, SELFMAG) != 0) {
+		fprintf(stderr, "Host: no guest symbols, %s is not ELF\n", gs->path);
+		fclose(fp);
+		free(buf);
+		return;
+	}
+	fclose(fp);
+	if (buf[EI_CLASS] == ELFCLASS64) {
+		Elf64_Ehdr *eh = (Elf64_Ehdr *)buf;
+		Elf64_Shdr *sh = (Elf64_Shdr *)(buf + eh->e_shoff);
+		for (int i = 0; i < eh->e_shnum; i++) {
+			if (sh[i].sh_type != SHT_SYMTAB) continue;
+			Elf64_Sym *sym = (Elf64_Sym *)(buf + sh[i].sh_offset);
+			char *strtab = buf + sh[sh[i].sh_link].sh_offset;
+			for (size_t j = 0; j < sh[i].sh_size / sizeof(Elf64_Sym); j++)
+				if (ELF64_ST_TYPE(sym[j].st_info) == STT_FUNC)
+					add_guest_sym(gs, sym[j].st_value, sym[j].st_size, strtab + sym[j].st_name);
+		}
+	} else {
+		Elf32_Ehdr *eh = (Elf32_Ehdr *)buf;
+		Elf32_Shdr *sh = (Elf32_Shdr *)(buf + eh->e_shoff);
+		for (int i = 0; i < eh->e_shnum; i++) {
+			if (sh[i].sh_type != SHT_SYMTAB) continue;
+			Elf32_Sym *sym = (Elf32_Sym *)(buf + sh[i].sh_offset);
+			char *strtab = buf + sh[sh[i].sh_link].sh_offset;
+			for (size_t j = 0; j < sh[i].sh_size / sizeof(Elf32_Sym); j++)
+				if (ELF32_ST_TYPE(sym[j].st_info) == STT_FUNC)
+					add_guest_sym(gs, sym[j].st_value, sym[j].st_size, strtab + sym[j].st_name);
+		}
+	}
+	free(buf);
+	qsort(gs->sym, gs->nr, sizeof(struct guest_sym), sym_cmp);
+}
+
+const char *guest_sym_name(struct guest_syms *gs, uint64_t addr) { // function containing addr, NULL if none.
+	int lo = 0, hi = gs->nr - 1, found = -1;
+	while (lo <= hi) { // last symbol starting at or below addr.
+		int mid = (lo + hi) / 2;
+		if (gs->sym[mid].addr <= addr) {
+			found = mid;
+			lo = mid + 1;
+		} else {
+			hi = mid - 1;
+		}
+	}
+	if (found < 0 || (gs->sym[found].size != 0 && addr >= gs->sym[found].addr + gs->sym[found].size)) return NULL;
+	return gs->sym[found].name;
+}
+
+struct profile_stack *profile_find(const struct profile_stack *key) { // slot of key's stack, empty slot if it is not in table.
+	for (uint32_t i = key->hash & (profile_size - 1);; i = (i + 1) & (profile_size - 1)) {
+		struct profile_stack *e = &profile_table[i];
+		if (e->hash == 0 || (e->hash == key->hash && e->vm_id == key->vm_id && e->word == key->word && e->depth == key->depth
+				     && memcmp(e->pc, key->pc, key->depth * sizeof(uint64_t)) == 0))
+			return e;
+	}
+}
+
+void profile_grow() {
+	struct profile_stack *old = profile_table;
+	int old_size = profile_size;
+
+	profile_size = old_size == 0 ? PROFILE_TABLE_MIN : old_size * 2;
+	profile_table = calloc(profile_size, sizeof(struct profile_stack));
+	if (profile_table == NULL) {
+		perror("calloc profile");
+		exit(1);
+	}
+	for (int i = 0; i < old_size; i++)
+		if (old[i].hash != 0) *profile_find(&old[i]) = old[i];
+	free(old);
+}
+
+void profile_sample(struct vm *vm, struct vcpu *vcpu) {
+	struct kvm_regs regs;
+	struct profile_stack key;
+	uint64_t *pc = key.pc;
+	int depth = 0;
+
+	if (ioctl(vcpu->fd, KVM_GET_REGS, &regs) < 0) {
+		perror("KVM_GET_REGS");
+		exit(1);
+	}
+	guest_mmu_sync(vcpu);
+	int word = (vcpu->mmu.efer & EFER_LMA) ? 8 : (vcpu->mmu.cr0 & CR0_PE) ? 4 : 0; // real mode stack is not walked.
+	pc[depth++] = regs.rip;
+	for (uint64_t fp = regs.rbp; word != 0 && fp != 0 && depth < PROFILE_MAX_DEPTH; ) { // [fp] = caller's fp, [fp+word] = return address.
+		char *frame = guest_span(vm, vcpu, fp, 2 * word);
+		if (frame == NULL) break;
+		uint64_t next = 0, ret = 0;
+		memcpy(&next, frame, word);
+		memcpy(&ret, frame + word, word);
+		if (ret == 0 || next <= fp) break; // stack grows down, callers' frames are above.
+		pc[depth++] = ret - 1; // inside the call instruction.
+		fp = next;
+	}
+
+	key.vm_id = vm->id;
+	key.word = word;
+	key.depth = depth;
+	key.count = 0;
+	key.hash = 0x243f6a8885a308d3ull ^ ((uint64_t)vm->id << 8 | word);
+	for (int i = 0; i < depth; i++) {
+		key.hash = (key.hash ^ pc[i]) * 0x9e3779b97f4a7c15ull;
+		key.hash ^= key.hash >> 29;
+	}
+	if (key.hash == 0) key.hash = 1;
+
+	pthread_mutex_lock(&profile_lock);
+	if ((profile_used + 1) * 2 > profile_size) profile_grow();
+	struct profile_stack *e = profile_find(&key);
+	if (e->hash == 0) {
+		memcpy(e, &key, sizeof(key));
+		profile_used++;
+	}
+	e->count++;
+	profile_nr++;
+	pthread_mutex_unlock(&profile_lock);
+}
+
+struct profile_line {
+	char *stack;	// folded: "vm0;_start;part_C;test_read".
+	uint64_t count;
+};
+
+int profile_line_cmp(const void *a, const void *b) {
+	return strcmp(((const struct profile_line *)a)->stack, ((const struct profile_line *)b)->stack);
+}
+
+void profile_write() { // folded stacks, one line per distinct stack with its sample count.
+	FILE *fp = fopen(profile_path, "w");
+	struct profile_line *lines = malloc((profile_used + 1) * sizeof(struct profile_line));
+	char line[PROFILE_MAX_DEPTH * 40];
+	int n = 0;
+
+	if (fp == NULL) {
+		perror(profile_path);
+		free(lines);
+		return;
+	}
+	for (int i = 0; i < profile_size; i++) { // raw stacks which differ only inside functions fold to the same line.
+		struct profile_stack *e = &profile_table[i];
+		if (e->hash == 0) continue;
+		struct guest_syms *gs = e->word == 8 ? &profile_syms[1] : e->word == 4 ? &profile_syms[0] : NULL;
+		if (gs != NULL && !gs->loaded) load_guest_syms(gs);
+		int len = snprintf(line, sizeof(line), "vm%d", e->vm_id);
+		for (int j = e->depth - 1; j >= 0 && len < (int)sizeof(line); j--) { // root first, cut at the end of line (long names).
+			const char *name = gs != NULL ? guest_sym_name(gs, e->pc[j]) : NULL;
+			if (name != NULL) len += snprintf(line + len, sizeof(line) - len, ";%s", name);
+			else len += snprintf(line + len, sizeof(line) - len, ";0x%lx", e->pc[j]);
+		}
+		lines[n].stack = strdup(line);
+		lines[n++].count = e->count;
+	}
+	qsort(lines, n, sizeof(struct profile_line), profile_line_cmp);
+	for (int i = 0, j; i < n; i = j) {
+		uint64_t count = 0;
+		for (j = i; j < n && strcmp(lines[i].stack, lines[j].stack) == 0; j++)
+			count += lines[j].count;
+		fprintf(fp, "%s %lu\n", lines[i].stack, count);
+	}
+	for (int i = 0; i < n; i++)
+		free(lines[i].stack);
+	free(lines);
+	fclose(fp);
+	printf("Host: %d profile samples written to %s\n", profile_nr, profile_path);
+}
+
+// what a run loop returns.
+#define VCPU_HALTED 1
+#define VCPU_PREEMPTED 2	// KVM_RUN was interrupted by a preempt kick (see kick_handler()), call run loop again to resume.
+#define VCPU_THROTTLED 3	// FS hypercall, CHAN_WAIT or BLK_WAIT is put off till vm->io.until (see io_throttle(), eventfd_park()), call run loop again then.
+#define VCPU_CRASHED 4		// exit host can not handle, guest is dumped and must not run again (see crash_dump()).
+
+// devices served by a run loop. run_vm_core() is inlined into one loop per combination so the compiler drops
+// handlers which are not used by that loop, the combination is selected once in main() (see select_run_loop()).
+#define DEV_CONSOLE (1 << 0)	// 0xE9, STDOUT and OUT_PORT are printed on host terminal.
+#define DEV_FS (1 << 1)		// FS_PORT file system hypercalls.
+#define DEV_BENCH (1 << 2)	// output ports (and FS_PORT, BALLOON_PORT, CHAN_DOORBELL, BLK_*) are accepted but discarded, only exits are counted.
+#define DEV_RECORD (1 << 3)	// every exit is recorded to trace file.
+#define DEV_BALLOON (1 << 4)	// BALLOON_PORT free page reporting.
+#define DEV_CHAN (1 << 5)	// channel between two guests, CHAN_* ports. without it guest sees no channel.
+#define DEV_BLK (1 << 6)	// block device, BLK_* ports. without it guest sees no disk.
+// devices left out at compile time (see CONFIG_*) are masked off in every loop.
+#define DEV_BUILT_IN (DEV_CONSOLE | DEV_BENCH | (CONFIG_TRACE ? DEV_RECORD : 0) | (CONFIG_FS ? DEV_FS : 0) \
+		      | (CONFIG_BALLOON ? DEV_BALLOON : 0) | (CONFIG_CHAN ? DEV_CHAN : 0) | (CONFIG_BLK ? DEV_BLK : 0))
+
+static inline __attribute__((always_inline))
+int run_vm_core(struct vm *vm, struct vcpu *vcpu, const int want) {
+	const int devices = want & DEV_BUILT_IN;
+	// kvm_run mapping, vcpu fd and guest memory never move so keep them in locals instead of going through vm/vcpu on every exit.
+	struct kvm_run *run = vcpu->kvm_run;
+	const int vcpu_fd = vcpu->fd;
+	const uint64_t hc_caps = ((devices & DEV_FS) ? HC_CAP_FS : 0) | ((devices & DEV_BALLOON) ? HC_CAP_BALLOON : 0);
+	struct rusage ru;
+
+	getrusage(RUSAGE_THREAD, &ru);	// page faults of this slice are added to guest stats when loop returns.
+	vm->stats.minflt -= ru.ru_minflt;
+	vm->stats.majflt -= ru.ru_majflt;
+	if (!vcpu->started) {
+		vcpu->started = 1;
+		vcpu->start_ns = now_ns();
+		if(devices & DEV_FS) fs_init(vm); // initializing my file system.
+	}
 	for (;;) { // infinite loop of runnig guest. since OS runs forever
+		if ((devices & (DEV_FS | DEV_CHAN | DEV_BLK)) && vcpu->io_pending) { // FS hypercall, CHAN_WAIT or BLK_WAIT in kvm_run was put off, try it again. (never with DEV_RECORD)
+			vcpu->io_pending = 0;
+			goto handle_io;
+		}
+		if(devices & DEV_RECORD) trace_record_exit(vm, vcpu); // previous exit is fully handled now.
 
-		if (ioctl(vcpu->fd, KVM_RUN, 0) < 0) { // Hypervisor transfers control to guest
+		PROBE(run_entry, vm->id, vcpu_fd);
+		if (ioctl(vcpu_fd, KVM_RUN, 0) < 0) { // Hypervisor transfers control to guest
+			if (errno == EINTR) { // kicked, guest stopped between instructions and nothing is pending.
+				run->immediate_exit = 0;
+				PROBE(run_exit, vm->id, -EINTR);
+				if (profile_pending) {
+					profile_pending = 0;
+					profile_sample(vm, vcpu);
+				}
+				if (!preempt_pending) continue;
+				preempt_pending = 0;
+				account_faults(vm);
+				return VCPU_PREEMPTED;
+			}
 			perror("KVM_RUN");
 			exit(1);
 		}
-		// control got back from guest to hypervisor.
-		switch (vcpu->kvm_run->exit_reason) { // this is why we allocated memory for vcpu so that it can write exit reason and communicate with KVM.
-		case KVM_EXIT_HLT:
-			goto check;
-
-		case KVM_EXIT_IO:
-			numExits += 1;
-			if (vcpu->kvm_run->io.direction == KVM_EXIT_IO_OUT
-			    && vcpu->kvm_run->io.port == 0xE9) {	// this is 8 bits port number. see in guest.c data is written to this port number.
-				char *p = (char *)vcpu->kvm_run;
-				fwrite(p + vcpu->kvm_run->io.data_offset,	// data_offset is relative to kvm_run address. It kvm_run+data_offset is address of where data is stored.
-				       vcpu->kvm_run->io.size, 1, stdout);	//io.size = 1. so 1*1 = 1 byte will be written fwrite(*ptr, size of one block to write, number of block, file stream). kvm->io.size is the size of data written(word size).
-				fflush(stdout);	// character by character data is written and for each character KVM_EXIT_IO happens.
-				continue;
-			}
-			
-			if (vcpu->kvm_run->io.direction == KVM_EXIT_IO_OUT) {
-				if (vcpu->kvm_run->io.port == STDOUT) {
-					char *p = (char *)vcpu->kvm_run + vcpu->kvm_run->io.data_offset;
-					uint32_t *ptr = (uint32_t *)p;
-					p = (char *)vm->mem + *ptr;
-					printf("%s", p);
+		guest_mmu_exit(vcpu);
+		if(devices & DEV_RECORD) trace_begin_exit(vm, vcpu);
+
+		// control got back from guest to hypervisor. this is why we allocated memory for vcpu so that it can write exit reason and communicate with KVM.
+		const uint32_t exit_reason = run->exit_reason;
+		PROBE(run_exit, vm->id, exit_reason);
+		if (vm->stats.exits++ == 0) vm->stats.first_exit_ns = now_ns() - vcpu->start_ns;
+		if (exit_reason == KVM_EXIT_HLT || (exit_reason == KVM_EXIT_IO && run->io.port == HALT_PORT)) {
+			vm->stats.run_ns = now_ns() - vcpu->start_ns;
+			account_faults(vm);
+			if(devices & DEV_FS) fs_release(vm);
+			if((devices & DEV_BLK) && vm->blk != NULL) blk_detach(vm);
+			return VCPU_HALTED;
+		}
+		if (exit_reason != KVM_EXIT_IO) goto crashed;
+
+		vm->stats.io_exits += 1;
+handle_io:;
+		const uint16_t port = run->io.port;
+		char *data = (char *)run + run->io.data_offset; // data_offset is relative to kvm_run address. It kvm_run+data_offset is address of where data is stored.
+		PROBE(io, vm->id, port, run->io.direction, run->io.size);
+		if (run->io.direction == KVM_EXIT_IO_OUT) {
+			switch (port) {
+			case 0xE9:	// this is 8 bits port number. see in guest.c data is written to this port number.
+				if (devices & DEV_CONSOLE) {
+					fwrite(data, run->io.size, 1, stdout);	//io.size = 1. so 1*1 = 1 byte will be written. character by character data is written and for each character KVM_EXIT_IO happens.
 					fflush(stdout);
-					// printf("VAL_32_PORT data offset : %lld,  io.size: %d\n", vcpu->kvm_run->io.data_offset, vcpu->kvm_run->io.size);
-					continue;
 				}
-				if (vcpu->kvm_run->io.port == OUT_PORT) {
-					char *p = (char *)vcpu->kvm_run + vcpu->kvm_run->io.data_offset;
-					uint32_t *ptr = (uint32_t *)p;
-					printf("%u\n", *ptr);
+				if (devices & (DEV_CONSOLE | DEV_BENCH)) continue;
+				break;
+			case STDOUT:
+				if (devices & DEV_CONSOLE) {
+					guest_mmu_sync(vcpu);
+					char *str = guest_string(vm, vcpu, *(uint32_t *)data, vm->mem_size); // data is guest virtual address of string.
+					if (str == NULL) str = "Host: Invalid String Memory Location\n";
+					printf("%s", str);
+					fflush(stdout);
+				}
+				if (devices & (DEV_CONSOLE | DEV_BENCH)) continue;
+				break;
+			case OUT_PORT:
+				if (devices & DEV_CONSOLE) {
+					printf("%u\n", *(uint32_t *)data);
 					fflush(stdout);
-					// printf("VAL_32_PORT data offset : %lld,  io.size: %d\n", vcpu->kvm_run->io.data_offset, vcpu->kvm_run->io.size);
-					continue;
 				}
-				if (vcpu->kvm_run->io.port == FS_PORT) {
-					uint32_t *ptr =(uint32_t *)((char *)vcpu->kvm_run + vcpu->kvm_run->io.data_offset);
-					uint32_t guest_mem_addr = *ptr; // guest_mem_addr is offset of struct from guest memory.
-
-					struct file_handler *fh_ptr = (struct file_handler *) ((char *)vm->mem + guest_mem_addr);
-					if(validate_guest_addr(vm->mem, fh_ptr, sizeof(struct file_handler)) == FALSE) {// should not be more than allocated memory for guest.
-						printf("Host: Invalid File Handler Memory Location\n");
-						continue;
-					}
-
-					if(fh_ptr->op == FS_OPEN) {
-						struct open_file *opn_ptr = (struct open_file *) ((char *)vm->mem + (uintptr_t)fh_ptr->op_struct);// fh_ptr->op_struct is logical address of guest means offset from vm->mem.
-						if(validate_guest_addr(vm->mem, opn_ptr, sizeof(struct open_file)) == FALSE) {
-							printf("Host: Invalid Open Struct Memory Location\n");
-							continue;
-						}
-						char *pathname = (char *)vm->mem + (uintptr_t)opn_ptr->pathname;
-						if(validate_guest_addr(vm->mem, pathname, strlen(pathname)) == FALSE) {
-							printf("Host: Invalid Pathname Memory Location\n");
-							opn_ptr->fd = -1;
-							continue;
-						}
-						int fd, flags, mode;
-						flags = get_open_flags(opn_ptr->flags);
-						mode = get_open_mode(opn_ptr->mode);
-						if(flags != -1 && opn_ptr->mode == -1) 
-							fd = open(pathname, flags);
-						else if(flags != -1 && mode != -1){
-							fd = open(pathname, flags, mode);
-						} else {
-							opn_ptr->fd = -1;
-							printf("Host: INVALID flags or mode\n");
-							continue;
-						}
-						if(fd < 0) {
-							fprintf(stderr, "%s\n", strerror(errno));
-							opn_ptr->fd = -1;
-							printf("Host: Stderror\n");
-							continue;
-						}
-
-						struct open_file_entry *eptr = make_entry();
-						eptr->fd = fd;
-						strcpy(eptr->pathname, pathname);
-						opn_ptr->fd = eptr->guest_fd;
-						printf("\nHost: opening file with pathname:%s", eptr->pathname);
-						print_file_table();
-						continue;
-					}
-					if(fh_ptr->op == FS_READ) {
-						struct read_file *rd_ptr = (struct read_file *) ((char *)vm->mem + (uintptr_t)fh_ptr->op_struct);
-						if(validate_guest_addr(vm->mem, rd_ptr, sizeof(struct read_file)) == FALSE) {
-							printf("Host: Invalid Read Struct Memory Location\n");
-							continue;
-						}
-						struct open_file_entry *eptr = get_entry(rd_ptr->fd);
-						if(eptr == NULL) {
-							printf("Host: File is not open\n");
-							rd_ptr->ssize = -1;
-							continue;
-						}
-						char *buf = (char *)vm->mem + (uintptr_t)rd_ptr->buf;
-						if(validate_guest_addr(vm->mem, buf, rd_ptr->size) == FALSE) { // entire buffer should be in guest memory no overflow.
-							printf("Host: Invalid Read Buffer Memory Location\n");
-							rd_ptr->ssize = -1;
-							continue;
-						}
-
-						rd_ptr->ssize = read(eptr->fd, buf, rd_ptr->size);
-						continue;
-					}
-					if(fh_ptr->op == FS_WRITE) {
-						struct write_file *wr_ptr = (struct write_file *) ((char *)vm->mem + (uintptr_t)fh_ptr->op_struct);
-						if(validate_guest_addr(vm->mem, wr_ptr, sizeof(struct write_file)) == FALSE) {
-							printf("Host: Invalid Write Struct Memory Location\n");
-							continue;
-						}
-						struct open_file_entry *eptr = get_entry(wr_ptr->fd);
-						if(eptr == NULL) {
-							printf("Host: File is not open\n");
-							wr_ptr->ssize = -1;
-							continue;
-						}
-						char *buf = (char *)vm->mem + (uintptr_t)wr_ptr->buf;
-						if(validate_guest_addr(vm->mem, buf, wr_ptr->count) == FALSE) { // entire buffer should be in guest memory no overflow.
-							printf("Host: Invalid Write Buffer Memory Location\n");
-							wr_ptr->ssize = -1;
-							continue;
-						}
-						// printf("count:%ld, buf is:%s\n", wr_ptr->count, buf);
-						// char buff[MAX_DATA];
-						// strcpy(buff, buf);
-						// printf("%s\n", buff);
-						if(strlen(buf) < wr_ptr->count) wr_ptr->count = strlen(buf);
-						wr_ptr->ssize = write(eptr->fd, buf, wr_ptr->count); // if binary data is written in sublime try opening in default text editor.
-						printf("Host: write ssize:%d\n", wr_ptr->ssize);
-						continue;
-					}
-					if(fh_ptr->op == FS_CLOSE) {
-						struct open_file_entry *eptr = get_entry(fh_ptr->fd);
-						if(eptr == NULL) {
-							printf("Host: File is not open\n");
-							fh_ptr->flag = -1;
-							continue;
-						}
-						fh_ptr->flag = close(eptr->fd);
-						if(fh_ptr->flag == 0) eptr->fd = -1;
-
-						printf("\nHost: closing file with pathname:%s", eptr->pathname);
-						print_file_table();
-						continue;
-					}
-					if(fh_ptr->op == FS_LSEEK) {
-						struct lseek_file *lsk_ptr = (struct lseek_file *) ((char *)vm->mem + (uintptr_t)fh_ptr->op_struct);
-						if(validate_guest_addr(vm->mem, lsk_ptr, sizeof(struct lseek_file)) == FALSE) {
-							printf("Host: Invalid Lseek Struct Memory Location\n");
-							continue;
-						}
-						struct open_file_entry *eptr = get_entry(lsk_ptr->fd);
-						if(eptr == NULL) {
-							printf("Host: File is not open\n");
-							lsk_ptr->foffset = -1;
-							continue;
-						}
-						int whence = get_lseek_whence(lsk_ptr->whence);
-						lsk_ptr->foffset = lseek(eptr->fd, lsk_ptr->offset, whence);
-						printf("Host: lseek foffset:%d\n", lsk_ptr->foffset);
-						continue;
-					}
-					if(fh_ptr->op == FS_ISOPEN) {
-						if(is_valid_fd(fh_ptr->fd) == TRUE) fh_ptr->flag = 1;
-						else fh_ptr->flag = 0;
-						continue;
-					}
-
-					printf("Host: INVALID FILE OPERATION\n");
+				if (devices & (DEV_CONSOLE | DEV_BENCH)) continue;
+				break;
+			case FS_PORT:
+				if ((devices & DEV_FS) && handle_fs(vm, vcpu, *(uint32_t *)data)) {
+					if (vm->io.until == 0) continue;
+					vcpu->io_pending = 1;
+					account_faults(vm);
+					return VCPU_THROTTLED;
 				}
-			}
-			if (vcpu->kvm_run->io.direction == KVM_EXIT_IO_IN) {
-				if (vcpu->kvm_run->io.port == IN_PORT) {
-					// we don't need io.size it is defined by assembly instruction in guest.c see there.
-					char *p = (char *)vcpu->kvm_run + vcpu->kvm_run->io.data_offset;
-					uint32_t *ptr = (uint32_t *)p;
-					*ptr = numExits;
+				if (devices & DEV_BENCH) continue; // request is dropped, guest sees its structs unchanged.
+				break;
+			case BALLOON_PORT:
+				if ((devices & DEV_BALLOON) && handle_balloon(vm, vcpu, *(uint32_t *)data)) continue;
+				if (devices & DEV_BENCH) continue;
+				break;
+			case METRICS_PORT:
+				if ((devices & DEV_CONSOLE) && handle_metrics_register(vm, *(uint32_t *)data)) continue;
+				if (devices & DEV_BENCH) continue;
+				break;
+			case HC_PORT:
+				if ((devices & DEV_CONSOLE) && handle_hc(vm, *(uint32_t *)data, hc_caps)) {
+					if (!(devices & DEV_FS) || vm->io.until == 0) continue;
+					vcpu->io_pending = 1;
+					account_faults(vm);
+					return VCPU_THROTTLED;
+				}
+				if (devices & DEV_BENCH) continue; // guest sees ret unchanged, HC_HELLO fails.
+				break;
+			case BLK_PORT:
+				if ((devices & DEV_BLK) && handle_blk_register(vm, *(uint32_t *)data)) continue;
+				if (devices & (DEV_CONSOLE | DEV_BENCH)) continue; // no disk, queue is left as it is (sectors = 0).
+				break;
+			case BLK_KICK:	// only when KVM_IOEVENTFD failed.
+				if ((devices & DEV_BLK) && vm->blk != NULL) {
+					blk_kick();
+					continue;
+				}
+				if (devices & DEV_BENCH) continue;
+				break;
+			case CHAN_DOORBELL:	// only when KVM_IOEVENTFD failed.
+				if ((devices & DEV_CHAN) && vm->chan != NULL) {
+					chan_doorbell(vm);
 					continue;
 				}
+				if (devices & DEV_BENCH) continue;
+				break;
 			}
-			printf("Host: INVALID IO OPERATION\n");
-			/* fall through */
-		default:
-			fprintf(stderr,	"Got exit_reason %d,"
-				" expected KVM_EXIT_HLT (%d)\n",
-				vcpu->kvm_run->exit_reason, KVM_EXIT_HLT);
+		} else if (port == IN_PORT) {
+			// we don't need io.size it is defined by assembly instruction in guest.c see there.
+			*(uint32_t *)data = vm->stats.io_exits - vm->io_exits_base;
+			continue;
+		} else if (port == BALLOON_PORT) { // inflate target.
+			if (devices & DEV_BALLOON) balloon_update_target(vm);
+			*(uint32_t *)data = vm->balloon_target;
+			continue;
+		} else if (port == CHAN_INFO) {
+			*(uint32_t *)data = (devices & DEV_CHAN) && vm->chan != NULL ? vm->chan_role : CHAN_NONE;
+			continue;
+		} else if (port == CHAN_WAIT) {
+			if (!(devices & DEV_CHAN) || vm->chan == NULL) {
+				*(uint32_t *)data = 0;
+				continue;
+			}
+			if (chan_wait(vm, vcpu, (uint32_t *)data)) continue;
+			vcpu->io_pending = 1;
+			account_faults(vm);
+			return VCPU_THROTTLED;
+		} else if (port == BLK_WAIT) {
+			if (!(devices & DEV_BLK)) {
+				*(uint32_t *)data = 0;
+				continue;
+			}
+			if (blk_wait(vm, vcpu, (uint32_t *)data)) continue;
+			vcpu->io_pending = 1;
+			account_faults(vm);
+			return VCPU_THROTTLED;
+		} else if (port == TIMER_INFO) {
+			*(uint32_t *)data = vm->irqchip ? vm->tsc_khz : 0;
+			continue;
+		}
+		printf("Host: INVALID IO OPERATION\n");
+		goto crashed;
+	}
+crashed:
+	crash_dump(vm, vcpu);
+	account_faults(vm);
+	if(devices & DEV_FS) fs_release(vm);
+	if((devices & DEV_BLK) && vm->blk != NULL) blk_detach(vm);
+	return VCPU_CRASHED;
+}
+
+int run_vm_console(struct vm *vm, struct vcpu *vcpu) { return run_vm_core(vm, vcpu, DEV_CONSOLE); }
+int run_vm_fs(struct vm *vm, struct vcpu *vcpu) { return run_vm_core(vm, vcpu, DEV_CONSOLE | DEV_FS | DEV_BALLOON | DEV_CHAN | DEV_BLK); }
+int run_vm_bench(struct vm *vm, struct vcpu *vcpu) { return run_vm_core(vm, vcpu, DEV_BENCH); }
+
+int run_vm_record(struct vm *vm, struct vcpu *vcpu) {
+	trace_open(vm->mem_size);
+	int ret = run_vm_core(vm, vcpu, DEV_CONSOLE | DEV_FS | DEV_BALLOON | DEV_RECORD);
+	trace_record_exit(vm, vcpu); // the HLT exit.
+	trace_close();
+	return ret;
+}
+
+int run_vm_replay(struct vm *vm, struct vcpu *vcpu) {
+	trace_open(vm->mem_size);
+	for (;;) {
+		if (ioctl(vcpu->fd, KVM_RUN, 0) < 0) {
+			if (errno == EINTR) { // only profile kicks, replay is never preempted.
+				vcpu->kvm_run->immediate_exit = 0;
+				profile_pending = 0;
+				profile_sample(vm, vcpu);
+				continue;
+			}
+			perror("KVM_RUN");
 			exit(1);
 		}
+		guest_mmu_exit(vcpu);
+		trace_begin_exit(vm, vcpu);
+		if (trace_replay_exit(vm, vcpu) == KVM_EXIT_HLT) break;
 	}
+	trace_close();
+	return VCPU_HALTED;
+}
+
+int (*run_loop)(struct vm *vm, struct vcpu *vcpu);
+
+void select_run_loop(int bench, int fs) {
+	if (CONFIG_TRACE && trace_mode == TRACE_RECORD) run_loop = run_vm_record;
+	else if (CONFIG_TRACE && trace_mode == TRACE_REPLAY) run_loop = run_vm_replay;
+	else if (bench) run_loop = run_vm_bench;
+	else if (fs) run_loop = run_vm_fs;
+	else run_loop = run_vm_console;
+}
+
+// sz is a constant in every caller so after inlining memcpy becomes a single load of the right width.
+static inline __attribute__((always_inline))
+int check_result(struct vm *vm, struct vcpu *vcpu, const size_t sz) {
+	struct kvm_regs regs;
+	uint64_t memval = 0;
 
- check:
 	if (ioctl(vcpu->fd, KVM_GET_REGS, &regs) < 0) {
 		perror("KVM_GET_REGS");
 		exit(1);
@@ -498,9 +3726,25 @@ int run_vm(struct vm *vm, struct vcpu *vcpu, size_t sz) {
 	return 1;
 }
 
+static inline __attribute__((always_inline))
+int run_vm(struct vm *vm, struct vcpu *vcpu, const size_t sz) {
+	int ok = 1;
+
+	if (vm_runs > 1) vm_snapshot(vm, vcpu);
+	for (int i = 0; i < vm_runs; i++) {
+		if (i > 0) vm_reset(vm, vcpu);
+		int ret;
+		while ((ret = run_loop(vm, vcpu)) != VCPU_HALTED && ret != VCPU_CRASHED)
+			if (ret == VCPU_THROTTLED) throttle_sleep(vm);
+		if (ret == VCPU_CRASHED) return 0;
+		ok &= check_result(vm, vcpu, sz);
+	}
+	return ok;
+}
+
 extern const unsigned char guest16[], guest16_end[];
 
-int run_real_mode(struct vm *vm, struct vcpu *vcpu)
+void load_real_mode(struct vm *vm, struct vcpu *vcpu) // set registers and copy guest code, guest is ready to run after this.
 {
 	struct kvm_sregs sregs;
 	struct kvm_regs regs;
@@ -532,6 +3776,11 @@ int run_real_mode(struct vm *vm, struct vcpu *vcpu)
 	}
 
 	memcpy(vm->mem, guest16, guest16_end-guest16);
+}
+
+int run_real_mode(struct vm *vm, struct vcpu *vcpu)
+{
+	load_real_mode(vm, vcpu);
 	return run_vm(vm, vcpu, 2);
 }
 
@@ -561,7 +3810,7 @@ static void setup_protected_mode(struct kvm_sregs *sregs)
 
 extern const unsigned char guest32[], guest32_end[];
 
-int run_protected_mode(struct vm *vm, struct vcpu *vcpu)
+void load_protected_mode(struct vm *vm, struct vcpu *vcpu) // set registers and copy guest code, guest is ready to run after this.
 {
 	struct kvm_sregs sregs;
 	struct kvm_regs regs;
@@ -574,6 +3823,7 @@ int run_protected_mode(struct vm *vm, struct vcpu *vcpu)
 	}
 
 	setup_protected_mode(&sregs);
+	sregs.cr4 |= vcpu_simd_cr4(vm);
 
         if (ioctl(vcpu->fd, KVM_SET_SREGS, &sregs) < 0) {
 		perror("KVM_SET_SREGS");
@@ -584,33 +3834,41 @@ int run_protected_mode(struct vm *vm, struct vcpu *vcpu)
 	/* Clear all FLAGS bits, except bit 1 which is always set. */
 	regs.rflags = 2;
 	regs.rip = 0;
+	regs.rsp = 2 << 20;	// top of guest RAM like long mode, guest code pushes (frame pointer) from its first instruction.
 
 	if (ioctl(vcpu->fd, KVM_SET_REGS, &regs) < 0) {
 		perror("KVM_SET_REGS");
 		exit(1);
 	}
 
-	memcpy(vm->mem, guest32, guest32_end-guest32);
+	guest_image_load(vm, guest32, guest32_end-guest32);
+}
+
+int run_protected_mode(struct vm *vm, struct vcpu *vcpu)
+{
+	load_protected_mode(vm, vcpu);
 	return run_vm(vm, vcpu, 4);
 }
 
 static void setup_paged_32bit_mode(struct vm *vm, struct kvm_sregs *sregs)
 {
-	uint32_t pd_addr = 0x2000;
+	uint32_t pd_addr = PT_BASE;
 	uint32_t *pd = (void *)(vm->mem + pd_addr);
 
 	/* A single 4MB page to cover the memory region */
 	pd[0] = PDE32_PRESENT | PDE32_RW | PDE32_USER | PDE32_PS;
+	if (vm->chan != NULL) // channel at the same virtual address.
+		pd[CHAN_ADDR >> 22] = CHAN_ADDR | PDE32_PRESENT | PDE32_RW | PDE32_USER | PDE32_PS;
 	/* Other PDEs are left zeroed, meaning not present. */
 
 	sregs->cr3 = pd_addr;
-	sregs->cr4 = CR4_PSE;
+	sregs->cr4 = CR4_PSE | vcpu_simd_cr4(vm);
 	sregs->cr0
 		= CR0_PE | CR0_MP | CR0_ET | CR0_NE | CR0_WP | CR0_AM | CR0_PG;
 	sregs->efer = 0;
 }
 
-int run_paged_32bit_mode(struct vm *vm, struct vcpu *vcpu)
+void load_paged_32bit_mode(struct vm *vm, struct vcpu *vcpu) // set registers and copy guest code, guest is ready to run after this.
 {
 	struct kvm_sregs sregs;
 	struct kvm_regs regs;
@@ -634,13 +3892,19 @@ int run_paged_32bit_mode(struct vm *vm, struct vcpu *vcpu)
 	/* Clear all FLAGS bits, except bit 1 which is always set. */
 	regs.rflags = 2;
 	regs.rip = 0;
+	regs.rsp = 2 << 20;	// top of guest RAM like long mode, guest code pushes (frame pointer) from its first instruction.
 
 	if (ioctl(vcpu->fd, KVM_SET_REGS, &regs) < 0) {
 		perror("KVM_SET_REGS");
 		exit(1);
 	}
 
-	memcpy(vm->mem, guest32, guest32_end-guest32);
+	guest_image_load(vm, guest32, guest32_end-guest32);
+}
+
+int run_paged_32bit_mode(struct vm *vm, struct vcpu *vcpu)
+{
+	load_paged_32bit_mode(vm, vcpu);
 	return run_vm(vm, vcpu, 4);
 }
 
@@ -677,13 +3941,13 @@ static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs)
 {	
 	// allocating virtual addresses to page tables of each level NOTE: virtual address of page table is fixed when process is loaded. physical address is changing because of swapping.
 	// setting the base address for 4rth level page table. but we are using only 3 level but usually we use 4 levels.
-	uint64_t pml4_addr = 0x2000;	//base address of pml4 table. offset from guest memory starting address. 0x2000 in hexadecimal = 0010,0000,0000,0000 = 2^13.
+	uint64_t pml4_addr = PT_BASE;	//base address of pml4 table. offset from guest memory starting address. tables are 4KB each and follow one another.
 	uint64_t *pml4 = (void *)(vm->mem + pml4_addr); // absolute pointer to pml4 table.
 
-	uint64_t pdpt_addr = 0x3000; // base address of pdpt_addr table
+	uint64_t pdpt_addr = PT_BASE + 0x1000; // base address of pdpt_addr table
 	uint64_t *pdpt = (void *)(vm->mem + pdpt_addr);// absolute pointer to pdpt table.
 
-	uint64_t pd_addr = 0x4000; // base address of pd_addr table.
+	uint64_t pd_addr = PT_BASE + 0x2000; // base address of pd_addr table.
 	uint64_t *pd = (void *)(vm->mem + pd_addr); // absolute pointer to pd_addr table.
 
 	// we know that there is only one page in process hence all the level of page tables will have single PTE so only 1st PTE is set for each level.
@@ -692,16 +3956,35 @@ static void setup_long_mode(struct vm *vm, struct kvm_sregs *sregs)
 	pd[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS;	// pd[0] is 1st PTE of pd table since guest memory is initialized with all zeros so no need to set the address of 1st(and only) page of process because guest physical address begin with all zeros.
 	//PDE64_PS is page size bit which indicates page pointed by this PTE is 2M not 4k. 
 
+	if (vm->chan != NULL) { // channel is one 2MB page at the same virtual address, CHAN_ADDR is 1GB so it is 2nd entry of pdpt.
+		uint64_t chan_pd_addr = PT_BASE + 0x3000;
+		uint64_t *chan_pd = (void *)(vm->mem + chan_pd_addr);
+		pdpt[CHAN_ADDR >> 30] = PDE64_PRESENT | PDE64_RW | PDE64_USER | chan_pd_addr;
+		chan_pd[0] = PDE64_PRESENT | PDE64_RW | PDE64_USER | PDE64_PS | CHAN_ADDR;
+	}
+
 	sregs->cr3 = pml4_addr;	// CR3 register is used to store the base address of highest level page table and we need to set it. because we can allocate pml4 table anywhere in guest memory.
-	sregs->cr4 = CR4_PAE;	// CR4_PAE is 5th bit(1<<5). by setting it page size is treated as 2MB instead of 4KB(default). it is Physical Address Extension means it change page table layout to translate 32 bit virtual address to 36 bit physical address.
+	sregs->cr4 = CR4_PAE | vcpu_simd_cr4(vm);	// CR4_PAE is 5th bit(1<<5). by setting it page size is treated as 2MB instead of 4KB(default). it is Physical Address Extension means it change page table layout to translate 32 bit virtual address to 36 bit physical address.
 	sregs->cr0
 		= CR0_PE | CR0_MP | CR0_ET | CR0_NE | CR0_WP | CR0_AM | CR0_PG;
 	sregs->efer = EFER_LME | EFER_LMA;
 
+	// GDT with the segments of setup_64bit_code_segment(), CPU reads CS of an interrupt gate from it. IDT is empty, guest puts its
+	// handlers in it (it finds IDT with sidt). both are after the page tables. (IDT page is zero so vm_reset() clears it.)
+	uint64_t gdt_addr = PT_BASE + 0x4000;
+	uint64_t *gdt = (void *)(vm->mem + gdt_addr);
+	gdt[0] = 0;
+	gdt[1] = 0x00af9b000000ffffull;	// 1 << 3: code, present, ring 0, long mode, accessed.
+	gdt[2] = 0x00cf93000000ffffull;	// 2 << 3: data, read/write, accessed.
+	sregs->gdt.base = gdt_addr;
+	sregs->gdt.limit = 3 * 8 - 1;
+	sregs->idt.base = PT_BASE + 0x5000;
+	sregs->idt.limit = 256 * 16 - 1;
+
 	setup_64bit_code_segment(sregs);
 }
 
-int run_long_mode(struct vm *vm, struct vcpu *vcpu)
+void load_long_mode(struct vm *vm, struct vcpu *vcpu) // set registers and copy guest code, guest is ready to run after this.
 {
 	struct kvm_sregs sregs; // special registers these will be store in vcpu memory.
 	struct kvm_regs regs;	// IP register, SP register, flags etc. are stored in this.
@@ -735,68 +4018,755 @@ int run_long_mode(struct vm *vm, struct vcpu *vcpu)
 	}
 
 	// vm->mem is virtual address of hypervisor(host) which is beginning of guest memory we are copying the code(to be executed by guest) in this address(beginning of memory) from guest64 (guest64 is the location of compiled asembly code of guest program to be executed).
-	memcpy(vm->mem, guest64, guest64_end-guest64); 
+	guest_image_load(vm, guest64, guest64_end-guest64);
 	// we allocated code segment at the beginning of guest memory. and set the rip (IP register) to point it.
-	printf("code segment loaded at host VA from:%p,   to %p, size: %ld Bytes\n", vm->mem, vm->mem+(guest64_end-guest64), guest64_end-guest64); // hypervisors virtual address.
+	debug_printf("code segment loaded at host VA from:%p,   to %p, size: %ld Bytes\n", vm->mem, vm->mem+(guest64_end-guest64), guest64_end-guest64); // hypervisors virtual address.
 	printf("code segment loaded at guest PA from: %lld,  to %lld\n", sregs.cs.base, sregs.cs.base+(guest64_end-guest64)); // guest physical address. using cs.base here does not make sense because we are storing code at vm->mem but we have also made vm->mem as physical address 0. and set cs.base = 0. 
+}
+
+int run_long_mode(struct vm *vm, struct vcpu *vcpu)
+{
+	load_long_mode(vm, vcpu);
 	return run_vm(vm, vcpu, 8);
 }
 
 
+//////////////////////////////////////// Multi VM ////////////////////////////////////////
+// -m manifest runs many guests in this one process. every guest gets its own VM and VCPU (with its own file table and stats)
+// created from the same /dev/kvm fd, and a fixed pool of worker threads (-w N) runs them, so a guest costs mostly its RAM
+// instead of a process. manifest has one line per kind of guest: "<real|protected|paged|long> [count] [@worker] [chan=N] [disk=image]",
+// '#' starts a comment. @worker is an affinity hint, the guest starts on that worker and other workers steal it only as last resort.
+// chan=N attaches the guest to shared memory channel N, a channel needs exactly two guests (see chan_attach()).
+// disk=image gives the guest a block device, every guest opens the image itself (see blk_open()).
+//
+// scheduling: every worker has its own run queue. it runs the guest at the head and when the guest was preempted puts it back
+// at the tail (round robin). an idle worker steals from the tail of other queues. a ticker thread kicks a vcpu which ran longer
+// than the time slice (-q us, 0 = run to completion) while other guests wait: SIGUSR1 to the worker thread makes KVM_RUN
+// return EINTR, and kick_handler() sets immediate_exit so a kick that lands just before KVM_RUN is not lost. a kick names the
+// slice it is for, so one that lands after the worker went on to another guest does not preempt that one.
+enum vm_mode {
+	REAL_MODE,
+	PROTECTED_MODE,
+	PAGED_32BIT_MODE,
+	LONG_MODE,
+};
+
+const char *mode_name[] = { "real", "protected", "paged", "long" };
+#define MODE_BUILT_IN(mode) ((CONFIG_MODES >> (mode)) & 1)
+void (*mode_load[])(struct vm *vm, struct vcpu *vcpu) = { // NULL for modes left out at compile time.
+	MODE_BUILT_IN(REAL_MODE) ? load_real_mode : NULL, MODE_BUILT_IN(PROTECTED_MODE) ? load_protected_mode : NULL,
+	MODE_BUILT_IN(PAGED_32BIT_MODE) ? load_paged_32bit_mode : NULL, MODE_BUILT_IN(LONG_MODE) ? load_long_mode : NULL };
+
+struct guest {
+	struct vm vm;
+	struct vcpu vcpu;
+	enum vm_mode mode;
+	int result;
+	int hint;		// preferred worker, -1 if none.
+	int chan_id;		// channel from manifest, -1 if none.
+	char *disk;		// disk image from manifest, NULL if none.
+	int worker;		// worker which ran it last.
+	uint64_t slices;	// times it was given a worker.
+	uint64_t migrations;	// times it ran on a different worker than last time.
+	int runs;		// runs finished, guest is reset and queued again till vm_runs.
+	uint64_t setup_ns;	// VM and VCPU creation and loading of guest.
+};
+
+struct worker {
+	pthread_t thread;
+	int id;
+	pthread_mutex_t lock;	// protects queue, head and tail.
+	struct guest **queue;	// ring of nr_guests + 1 slots so it never overflows.
+	int head, tail;
+	struct kvm_run *running;	// kvm_run of vcpu in KVM_RUN on this worker, NULL if none. read by ticker.
+	uint64_t slice_start;
+	uint64_t slice;		// number of the slice running, stored after slice_start.
+	uint64_t kick_slice;	// slice ticker kicked last, kick_handler() drops a kick for any other.
+	uint64_t steals;
+};
+
+struct guest *guests;
+int nr_guests;
+struct worker *workers_tab;
+int nr_workers;
+uint64_t slice_ns = 2000000;
+int guests_left;	// guests which did not halt yet.
+int queued;		// guests waiting in run queues, ticker kicks nobody when it is 0.
+int load_manifest(const char *path) {
+	char line[256];
+	int lineno = 0;
+	FILE *fp = fopen(path, "r");
+
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+	while (fgets(line, sizeof(line), fp) != NULL) {
+		lineno++;
+		char *comment = strchr(line, '#');
+		if (comment != NULL) *comment = '\0';
+		char *tok = strtok(line, " \t\r\n");
+		if (tok == NULL) continue; // empty line.
+
+		int mode, count = 1, hint = -1, chan_id = -1, bad = 0;
+		char *disk = NULL;
+		for (mode = REAL_MODE; mode <= LONG_MODE; mode++)
+			if (strcmp(tok, mode_name[mode]) == 0) break;
+		while ((tok = strtok(NULL, " \t\r\n")) != NULL) {
+			char *num = tok, *end;
+			if (strncmp(tok, "disk=", 5) == 0) {
+				disk = strdup(tok + 5);
+				bad |= disk[0] == '\0';
+				continue;
+			}
+			if (tok[0] == '@') hint = strtol(num = tok + 1, &end, 10);
+			else if (strncmp(tok, "chan=", 5) == 0) chan_id = strtol(num = tok + 5, &end, 10);
+			else count = strtol(tok, &end, 10);
+			bad |= *end != '\0' || end == num;
+		}
+		if (bad || mode > LONG_MODE || count < 1 || hint < -1 || chan_id < -1) {
+			fprintf(stderr, "%s:%d: expected \"<real|protected|paged|long> [count] [@worker] [chan=N] [disk=image]\"\n", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+		if (!MODE_BUILT_IN(mode) || (!CONFIG_CHAN && chan_id >= 0) || (!CONFIG_BLK && disk != NULL)) {
+			fprintf(stderr, "%s:%d: mode, chan= or disk= is not built in\n", path, lineno);
+			fclose(fp);
+			return -1;
+		}
+		guests = realloc(guests, (nr_guests + count) * sizeof(struct guest));
+		for (int i = 0; i < count; i++) {
+			guests[nr_guests].mode = mode;
+			guests[nr_guests].hint = hint;
+			guests[nr_guests].chan_id = chan_id;
+			guests[nr_guests].disk = disk;
+			nr_guests++;
+		}
+	}
+	fclose(fp);
+	return nr_guests;
+}
+
+void rq_push(struct worker *w, struct guest *g) {
+	pthread_mutex_lock(&w->lock);
+	w->queue[w->tail] = g;
+	w->tail = (w->tail + 1) % (nr_guests + 1);
+	pthread_mutex_unlock(&w->lock);
+	__atomic_add_fetch(&queued, 1, __ATOMIC_RELAXED);
+}
+
+int rq_len(struct worker *w) {
+	pthread_mutex_lock(&w->lock);
+	int len = (w->tail - w->head + nr_guests + 1) % (nr_guests + 1);
+	pthread_mutex_unlock(&w->lock);
+	return len;
+}
+
+struct guest *rq_pop(struct worker *w) { // owner takes from head.
+	struct guest *g = NULL;
+	pthread_mutex_lock(&w->lock);
+	if (w->head != w->tail) {
+		g = w->queue[w->head];
+		w->head = (w->head + 1) % (nr_guests + 1);
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (g != NULL) __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+	return g;
+}
+
+struct guest *rq_steal(struct worker *w, int take_hinted) { // thief takes from tail.
+	struct guest *g = NULL;
+	pthread_mutex_lock(&w->lock);
+	if (w->head != w->tail) {
+		int last = (w->tail + nr_guests) % (nr_guests + 1);
+		if (take_hinted || w->queue[last]->hint < 0) {
+			g = w->queue[last];
+			w->tail = last;
+		}
+	}
+	pthread_mutex_unlock(&w->lock);
+	if (g != NULL) __atomic_sub_fetch(&queued, 1, __ATOMIC_RELAXED);
+	return g;
+}
+
+struct guest *sched_steal(struct worker *w) {
+	for (int take_hinted = 0; take_hinted <= 1; take_hinted++) { // leave guests with affinity hint alone if possible.
+		for (int i = 1; i < nr_workers; i++) {
+			struct guest *g = rq_steal(&workers_tab[(w->id + i) % nr_workers], take_hinted);
+			if (g != NULL) {
+				w->steals++;
+				return g;
+			}
+		}
+	}
+	return NULL;
+}
+
+int guest_check(struct guest *g) {
+	switch (g->mode) {
+	case REAL_MODE:
+		return check_result(&g->vm, &g->vcpu, 2);
+	case PROTECTED_MODE:
+	case PAGED_32BIT_MODE:
+		return check_result(&g->vm, &g->vcpu, 4);
+	case LONG_MODE:
+		return check_result(&g->vm, &g->vcpu, 8);
+	}
+	return 0;
+}
+
+void *sched_worker(void *arg) {
+	struct worker *w = arg;
+	struct timespec idle = { 0, 100000 };	// 100us
+	int skipped = 0;	// throttled guests put back in a row.
+
+	pin_vcpu_thread(w->id);	// one worker per host cpu (of -N node), so a guest stays on the cpu of its worker.
+	kick_target = &w->kick_slice;
+
+	while (__atomic_load_n(&guests_left, __ATOMIC_ACQUIRE) > 0) {
+		struct guest *g = rq_pop(w);
+		if (g == NULL) g = sched_steal(w);
+		if (g == NULL) {
+			nanosleep(&idle, NULL);
+			continue;
+		}
+		if (g->vm.io.until > now_ns()) { // throttled, let the others run first.
+			rq_push(w, g);
+			if (++skipped > rq_len(w)) { // went round the queue, all of them are.
+				nanosleep(&idle, NULL);
+				skipped = 0;
+			}
+			continue;
+		}
+		skipped = 0;
+		if (g->slices == 0) {
+			uint64_t t = now_ns();
+			mode_load[g->mode](&g->vm, &g->vcpu);
+			g->setup_ns += now_ns() - t;
+			if (vm_runs > 1) vm_snapshot(&g->vm, &g->vcpu);
+		} else if (g->worker != w->id) g->migrations++;
+		g->worker = w->id;
+		g->slices++;
+
+		kick_slice = w->slice + 1;
+		kick_run = g->vcpu.kvm_run;
+		kick_run->immediate_exit = 0;	// drop a late kick meant for its previous slice.
+		preempt_pending = 0;
+		__atomic_store_n(&w->slice_start, now_ns(), __ATOMIC_RELAXED);
+		__atomic_store_n(&w->slice, kick_slice, __ATOMIC_RELEASE);
+		__atomic_store_n(&w->running, kick_run, __ATOMIC_RELEASE);
+		int ret = run_loop(&g->vm, &g->vcpu);
+		__atomic_store_n(&w->running, NULL, __ATOMIC_RELEASE);
+		kick_run = NULL;
+
+		if (ret == VCPU_THROTTLED) {
+			rq_push(w, g);
+			continue;
+		}
+		if (ret == VCPU_PREEMPTED) {
+			dedup_scan_due(&g->vm);
+			rq_push(w, g);
+			continue;
+		}
+		if (ret == VCPU_CRASHED) { // dump thread finishes its lazy restore.
+			g->result = 0;
+			__atomic_sub_fetch(&guests_left, 1, __ATOMIC_RELEASE);
+			continue;
+		}
+		g->result = (g->runs == 0 || g->result) && guest_check(g);
+		if (++g->runs < vm_runs) { // same VM again, from its snapshot.
+			vm_reset(&g->vm, &g->vcpu);
+			dedup_scan_due(&g->vm);
+			rq_push(w, g);
+			continue;
+		}
+		lazy_finish(&g->vm);
+		__atomic_sub_fetch(&guests_left, 1, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+void *sched_ticker(void *arg) {
+	struct timespec tick = { slice_ns / 2 / 1000000000, slice_ns / 2 % 1000000000 };
+	(void)arg;
+
+	while (__atomic_load_n(&guests_left, __ATOMIC_ACQUIRE) > 0) {
+		nanosleep(&tick, NULL);
+		if (__atomic_load_n(&queued, __ATOMIC_RELAXED) == 0) continue; // nobody is waiting, let them run.
+		uint64_t now = now_ns();
+		for (int i = 0; i < nr_workers; i++) {
+			struct worker *w = &workers_tab[i];
+			// slice is read before slice_start, which is stored first, so slice_start is never older than that slice.
+			uint64_t slice = __atomic_load_n(&w->slice, __ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&w->running, __ATOMIC_ACQUIRE) != NULL
+			    && now - __atomic_load_n(&w->slice_start, __ATOMIC_RELAXED) >= slice_ns) {
+				__atomic_store_n(&w->kick_slice, slice, __ATOMIC_RELEASE);
+				pthread_kill(w->thread, SIGUSR1);
+			}
+		}
+	}
+	return NULL;
+}
+
+// kicks vcpu threads for profile samples till profile_stop. arg is the vcpu thread of a single guest, NULL for the workers.
+void *profile_ticker(void *arg) {
+	pthread_t *target = arg;
+	uint64_t period = 1000000000 / profile_hz;
+	struct timespec tick = { period / 1000000000, period % 1000000000 };
+
+	while (!__atomic_load_n(&profile_stop, __ATOMIC_ACQUIRE)) {
+		nanosleep(&tick, NULL);
+		if (target != NULL) {
+			pthread_kill(*target, SIGUSR2);
+			continue;
+		}
+		for (int i = 0; i < nr_workers; i++)
+			if (__atomic_load_n(&workers_tab[i].running, __ATOMIC_ACQUIRE) != NULL)
+				pthread_kill(workers_tab[i].thread, SIGUSR2);
+	}
+	return NULL;
+}
+
+void profile_start(pthread_t *profiler, pthread_t *target) {
+	if (pthread_create(profiler, NULL, profile_ticker, target) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+}
+
+void profile_finish(pthread_t profiler) {
+	__atomic_store_n(&profile_stop, 1, __ATOMIC_RELEASE);
+	pthread_join(profiler, NULL);
+	profile_write();
+}
+
+void print_guest_stats() {
+	printf("\n  VM  mode       result      exits   io_exits   fs_ops     run_us  first_us  minflt  slices  migrations  rss_kb  balloon_kb\n");
+	for (int i = 0; i < nr_guests; i++) {
+		struct vm_stats *st = &guests[i].vm.stats;
+		printf("%4d  %-9s  %-6s  %9lu  %9lu  %7lu  %9lu  %8lu  %6lu  %6lu  %10lu  %6lu  %10lu\n", i, mode_name[guests[i].mode],
+		       guests[i].result ? "ok" : "FAIL", st->exits, st->io_exits, st->fs_ops, st->run_ns / 1000,
+		       st->first_exit_ns / 1000, st->minflt, guests[i].slices, guests[i].migrations, vm_resident_pages(&guests[i].vm) * PAGE_SIZE / 1024,
+		       (st->balloon_freed + st->balloon_lazy) * PAGE_SIZE / 1024);
+	}
+	printf("KSM: pages shared %ld sharing %ld\n", read_ulong_file("/sys/kernel/mm/ksm/pages_shared"),
+	       read_ulong_file("/sys/kernel/mm/ksm/pages_sharing"));
+	for (int i = 0; i < nr_workers; i++)
+		printf("worker %d: stole %lu guests\n", i, workers_tab[i].steals);
+	for (int i = 0; i < nr_guests; i++) {
+		struct vm_stats *st = &guests[i].vm.stats;
+		if (st->resets > 0)
+			printf("VM %d: %lu resets, %lu us each, %lu pages dropped %lu copied\n", i, st->resets,
+			       st->reset_ns / st->resets / 1000, st->reset_dropped, st->reset_copied);
+		print_io_stats(&guests[i].vm);
+		print_lazy_stats(&guests[i].vm);
+		if (guests[i].disk != NULL)
+			printf("disk of VM %d: %lu requests in %lu syscalls, %lu completion batches\n", i, st->blk_reqs, st->blk_syscalls, st->blk_batches);
+	}
+	print_fd_pool_stats();
+	for (int i = 0; i < nr_channels; i++) {
+		struct channel *ch = &channels[i];
+		printf("channel %d: producer VM %d waited %lu times (%lu timeouts), consumer VM %d waited %lu times (%lu timeouts)\n", ch->id,
+		       ch->end[0]->id, ch->end[0]->stats.chan_waits, ch->end[0]->stats.chan_timeouts,
+		       ch->end[1]->id, ch->end[1]->stats.chan_waits, ch->end[1]->stats.chan_timeouts);
+	}
+}
+
+int run_guests(int sys_fd, int workers) { // runs guests[] on workers, returns number of guests which failed.
+	pthread_t ticker, profiler, metrics;
+	int failed = 0;
+
+	nr_workers = workers;
+	if (dedup_ms >= 0) dedup_init();
+	workers_tab = calloc(nr_workers, sizeof(struct worker));
+	for (int i = 0; i < nr_workers; i++) {
+		workers_tab[i].id = i;
+		pthread_mutex_init(&workers_tab[i].lock, NULL);
+		workers_tab[i].queue = malloc((nr_guests + 1) * sizeof(struct guest *));
+	}
+	for (int i = 0; i < nr_guests; i++) {
+		struct guest *g = &guests[i];
+		uint64_t t = now_ns();
+		vm_init(&g->vm, sys_fd, vm_size);
+		g->vm.id = i;
+		metrics_add_vm(&g->vm);
+		if (use_irqchip && g->mode != REAL_MODE) vm_irqchip_init(&g->vm);
+		vcpu_init(&g->vm, &g->vcpu);
+		if (g->disk != NULL) blk_open(&g->vm, g->disk);
+		else if (dedup_ms >= 0) dedup_attach(&g->vm);
+		g->result = 0;
+		g->runs = 0;
+		g->slices = g->migrations = 0;
+		g->worker = g->hint >= 0 ? g->hint % nr_workers : i % nr_workers;
+		g->setup_ns = now_ns() - t;
+	}
+	for (int i = 0; i < nr_guests; i++) // create all channels first, chan_get() moves them.
+		if (guests[i].chan_id >= 0) chan_get(guests[i].chan_id);
+	for (int i = 0; i < nr_guests; i++)
+		if (guests[i].chan_id >= 0) chan_attach(&guests[i].vm, chan_get(guests[i].chan_id));
+	for (int i = 0; i < nr_channels; i++) {
+		if (channels[i].end[1] == NULL) {
+			fprintf(stderr, "channel %d: needs two guests\n", channels[i].id);
+			return 1;
+		}
+	}
+	for (int i = 0; i < nr_guests; i++)
+		rq_push(&workers_tab[guests[i].worker], &guests[i]);
+	guests_left = nr_guests;
+	printf("Running %d guests on %d worker threads, time slice %lu us\n", nr_guests, nr_workers, slice_ns / 1000);
+
+	kick_init();
+
+	for (int i = 0; i < nr_workers; i++) {
+		if (pthread_create(&workers_tab[i].thread, NULL, sched_worker, &workers_tab[i]) != 0) {
+			perror("pthread_create");
+			exit(1);
+		}
+	}
+	if (slice_ns > 0 && pthread_create(&ticker, NULL, sched_ticker, NULL) != 0) {
+		perror("pthread_create");
+		exit(1);
+	}
+	if (profile_path != NULL) profile_start(&profiler, NULL);
+	if (metrics_path != NULL) metrics_start(&metrics);
+	for (int i = 0; i < nr_workers; i++)
+		pthread_join(workers_tab[i].thread, NULL);
+	if (slice_ns > 0)
+		pthread_join(ticker, NULL);
+	if (profile_path != NULL) profile_finish(profiler);
+	if (metrics_path != NULL) metrics_finish(metrics);
+	crash_wait();
+	if (dedup_ms >= 0) {
+		struct vm *vms[nr_guests];
+		for (int i = 0; i < nr_guests; i++)
+			vms[i] = &guests[i].vm;
+		print_dedup_stats(vms, nr_guests);
+	}
+
+	for (int i = 0; i < nr_guests; i++)
+		failed += !guests[i].result;
+	return failed;
+}
+
+int run_multi(int sys_fd, const char *manifest, int workers) { // returns number of guests which failed.
+	if (load_manifest(manifest) <= 0) {
+		fprintf(stderr, "%s: no guests to run\n", manifest);
+		return 1;
+	}
+	int failed = run_guests(sys_fd, workers);
+	print_guest_stats();
+	return failed;
+}
+
+//////////////////////////////////////// Self test ////////////////////////////////////////
+// -t N runs N guests of every mode (or of the modes given with -r/-s/-p/-l) at the same time in this process, on the -m workers,
+// and checks every one like run_vm() does (rax and mem[0x400] are 42). report has per mode percentiles of VM setup time
+// (VM, VCPU and guest load), time to first exit and run time, so it is a smoke test and a startup latency benchmark at once.
+int cmp_u64(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+void print_percentiles(uint64_t *val, int n) { // sorts val, prints p50/p90/p99/max in us.
+	qsort(val, n, sizeof(uint64_t), cmp_u64);
+	for (int p = 0; p < 3; p++) {
+		int pct = (int[]){ 50, 90, 99 }[p];
+		int idx = (pct * n + 99) / 100 - 1; // nearest rank.
+		printf(" %7lu", val[idx < 0 ? 0 : idx] / 1000);
+	}
+	printf(" %7lu", val[n - 1] / 1000);
+}
+
+int run_selftest(int sys_fd, int modes, int reps, int workers) { // returns number of guests which failed.
+	for (int mode = REAL_MODE; mode <= LONG_MODE; mode++) {
+		if (!(modes & (1 << mode))) continue;
+		guests = realloc(guests, (nr_guests + reps) * sizeof(struct guest));
+		for (int i = 0; i < reps; i++) {
+			guests[nr_guests].mode = mode;
+			guests[nr_guests].hint = -1;
+			guests[nr_guests].chan_id = -1;
+			guests[nr_guests].disk = NULL;
+			nr_guests++;
+		}
+	}
+	uint64_t t = now_ns();
+	int failed = run_guests(sys_fd, workers);
+	t = now_ns() - t;
+
+	uint64_t *setup = malloc(reps * sizeof(uint64_t)), *first = malloc(reps * sizeof(uint64_t)), *run = malloc(reps * sizeof(uint64_t));
+	printf("\nself test: %d guests in %lu us\n", nr_guests, t / 1000);
+	printf("mode       guests  failed |%32s |%32s |%32s\n", "setup_us p50/p90/p99/max", "first_exit_us p50/p90/p99/max", "run_us p50/p90/p99/max");
+	for (int i = 0; i < nr_guests; i += reps) {
+		int mode_failed = 0;
+		for (int j = 0; j < reps; j++) {
+			struct guest *g = &guests[i + j];
+			setup[j] = g->setup_ns;
+			first[j] = g->vm.stats.first_exit_ns;
+			run[j] = g->vm.stats.run_ns;
+			mode_failed += !g->result;
+		}
+		printf("%-9s  %6d  %6d |", mode_name[guests[i].mode], reps, mode_failed);
+		print_percentiles(setup, reps);
+		printf(" |");
+		print_percentiles(first, reps);
+		printf(" |");
+		print_percentiles(run, reps);
+		printf("\n");
+	}
+	free(setup);
+	free(first);
+	free(run);
+	printf("self test %s\n", failed == 0 ? "passed" : "FAILED");
+	return failed;
+}
+
 int main(int argc, char **argv)
 {
 	struct vm vm;
 	struct vcpu vcpu;
-	enum {
-		REAL_MODE,
-		PROTECTED_MODE,
-		PAGED_32BIT_MODE,
-		LONG_MODE,
-	} mode = REAL_MODE;
-	int opt;
+	enum vm_mode mode = REAL_MODE;
+	int opt, sys_fd;
 
 	// check the execution mode optional parameters in command line.
-	while ((opt = getopt(argc, argv, "rspl")) != -1) { // ./kvm-hello-world -l   so it will check whether it is -l (64 bit mode) you can do by splitting on your own.
+	int bench = 0;
+	int modes = 0, selftest = -1; // modes is a mask of modes given, for -t.
+	char *manifest = NULL;
+	char *disk = NULL;
+	int workers = sysconf(_SC_NPROCESSORS_ONLN);
+
+	while ((opt = getopt(argc, argv, "rsplbIo:i:m:t:w:q:K:L:Q:U:H:C:B:P:N:M:d:n:S:F:E:")) != -1) { // ./kvm-hello-world -l   so it will check whether it is -l (64 bit mode) you can do by splitting on your own.
 		switch (opt) {
 		case 'r':
 			mode = REAL_MODE;
+			modes |= 1 << mode;
 			break;
 
 		case 's':
 			mode = PROTECTED_MODE;
+			modes |= 1 << mode;
 			break;
 
 		case 'p':
 			mode = PAGED_32BIT_MODE;
+			modes |= 1 << mode;
 			break;
 
 		case 'l':
 			mode = LONG_MODE;
+			modes |= 1 << mode;
+			break;
+
+		case 'b': // benchmark payloads, guest output is discarded and FS hypercalls are not served.
+			bench = 1;
+			break;
+
+		case 'I': // in-kernel irqchip, guest gets LAPIC timer interrupts.
+			use_irqchip = 1;
+			break;
+
+		case 'o': // record all exits to trace file.
+			trace_mode = TRACE_RECORD;
+			trace_path = optarg;
+			break;
+
+		case 'i': // replay exits from trace file, host FS is not touched.
+			trace_mode = TRACE_REPLAY;
+			trace_path = optarg;
+			break;
+
+		case 'm': // run all guests listed in manifest file.
+			manifest = optarg;
+			break;
+
+		case 't': // self test, this many guests of every mode run at once.
+			selftest = atoi(optarg);
+			break;
+
+		case 'w': // worker threads for -m and -t.
+			workers = atoi(optarg);
+			break;
+
+		case 'K': // host dedup of guest RAM for -m/-t, a guest is scanned at most once per this many ms.
+			dedup_ms = atol(optarg);
+			break;
+
+		case 'L': // per VM limits of FS hypercalls: hypercalls/s,bytes/s,reads+writes/s, 0 = no limit.
+			if (sscanf(optarg, "%lf,%lf,%lf", &io_limit_hc, &io_limit_bytes, &io_limit_iops) != 3) {
+				fprintf(stderr, "-L needs hypercalls,bytes,iops per second\n");
+				return 1;
+			}
+			break;
+
+		case 'Q': // fair queue in front of host files, this many operations at once.
+			fq_depth = atoi(optarg);
+			break;
+
+		case 'U': // guest image is loaded on demand with userfaultfd, fault order is recorded to / prefetched from this file.
+			lazy_path = optarg;
+			break;
+
+		case 'C': // directory crash dumps are written to.
+			crash_dir = optarg;
+			break;
+
+		case 'H': // host fds of closed guest files kept open for the next open, 0 = none.
+			fd_pool_size = atoi(optarg);
+			break;
+
+		case 'B': // KB of guest RAM allowed to stay resident, above it guest is asked to inflate its balloon.
+			balloon_limit = strtoull(optarg, NULL, 0) * 1024 / PAGE_SIZE;
+			break;
+
+		case 'P': // prefault guest RAM, 1 = MAP_POPULATE, N = N threads.
+			prefault_threads = atoi(optarg);
+			break;
+
+		case 'N': // numa node for guest RAM and vcpu threads.
+			numa_node = atoi(optarg);
+			break;
+
+		case 'n': // run guest this many times in the same VM, resetting it in between.
+			vm_runs = atoi(optarg);
+			break;
+
+		case 'S': // write folded stacks of guest profile to this file.
+			profile_path = optarg;
+			break;
+
+		case 'F': // profile samples per second.
+			profile_hz = atoi(optarg);
+			break;
+
+		case 'E': // export host and guest metrics to this file (Prometheus text format).
+			metrics_path = optarg;
+			break;
+
+		case 'd': // disk image for the guest block device.
+			disk = optarg;
+			break;
+
+		case 'M': // MB of guest RAM.
+			vm_size = strtoull(optarg, NULL, 0) << 20;
+			break;
+
+		case 'q': // time slice in us for -m, 0 means guests run till they halt.
+			slice_ns = strtoull(optarg, NULL, 0) * 1000;
 			break;
 
 		default:
-			fprintf(stderr, "Usage: %s [ -r | -s | -p | -l ]\n",
-				argv[0]);
+			fprintf(stderr, "Usage: %s [ -r | -s | -p | -l ] [ -b ] [ -I ] [ -o trace | -i trace ] [ -B limit_kb ] [ -d disk_image ] [ -n runs ]\n"
+				"       %s -m manifest [ -w workers ] [ -q slice_us ] [ -b ] [ -I ] [ -B limit_kb ] [ -n runs ] [ -K dedup_ms ]\n"
+				"       %s -t guests_per_mode [ -r ] [ -s ] [ -p ] [ -l ] [ -w workers ] [ -q slice_us ] [ -I ] [ -K dedup_ms ]\n"
+				"       memory options: [ -M mem_mb ] [ -P prefault_threads ] [ -N numa_node ] [ -U fault_order_file ]\n"
+				"       I/O options: [ -L hypercalls,bytes,iops ] [ -Q fair_queue_depth ] [ -H host_fd_pool_size ] [ -C crash_dump_dir ]\n"
+				"       profile options: [ -S folded_stacks_file ] [ -F samples_per_sec ] [ -E metrics_file ]\n",
+				argv[0], argv[0], argv[0]);
+			return 1;
+		}
+	}
+
+	if ((manifest == NULL && selftest == -1 && !MODE_BUILT_IN(mode)) || (modes & ~CONFIG_MODES) || (!CONFIG_TRACE && trace_mode != TRACE_OFF)
+	    || (!CONFIG_BLK && disk != NULL) || (!CONFIG_BALLOON && balloon_limit > 0)) {
+		fprintf(stderr, "mode, -o/-i, -d or -B is not built in (see CONFIG_* in Makefile FEATURES)\n");
+		return 1;
+	}
+	if (dedup_ms >= 0 && manifest == NULL && selftest == -1) {
+		fprintf(stderr, "-K works with -m or -t, a single guest has nothing to share pages with\n");
+		return 1;
+	}
+	if (vm_size < 0x200000 || prefault_threads < 0 || numa_node < -1 || numa_node >= 1024) {
+		fprintf(stderr, "guest needs at least 2 MB RAM, -P and -N can not be negative or too big\n");
+		return 1;
+	}
+	if (prefault_threads > 0 && vm_runs > 1)
+		fprintf(stderr, "warning: -P prefaults guest RAM only for the first run, -n drops the pages a run touched before the next one\n");
+	if (disk != NULL && trace_mode != TRACE_OFF) { // I/O thread writes guest memory behind the trace's back.
+		fprintf(stderr, "-d can not be used with -o/-i\n");
+		return 1;
+	}
+	if (io_limit_hc < 0 || io_limit_bytes < 0 || io_limit_iops < 0 || fq_depth < 0
+	    || ((io_limit_hc > 0 || io_limit_bytes > 0 || io_limit_iops > 0) && trace_mode != TRACE_OFF)) { // a put off exit would be recorded twice.
+		fprintf(stderr, "-L and -Q can not be negative, -L can not be used with -o/-i\n");
+		return 1;
+	}
+	if (use_irqchip && trace_mode != TRACE_OFF) { // interrupts come at times a replay can not repeat.
+		fprintf(stderr, "-I can not be used with -o/-i\n");
+		return 1;
+	}
+	if (profile_hz < 1 || profile_hz > 100000) {
+		fprintf(stderr, "-F must be 1 to 100000 samples per second\n");
+		return 1;
+	}
+	if (vm_runs < 1 || (vm_runs > 1 && trace_mode != TRACE_OFF)) { // a trace holds one run.
+		fprintf(stderr, "-n needs runs >= 1 and can not be used with -o/-i\n");
+		return 1;
+	}
+	placement_init();
+	sys_fd = kvm_open();
+	if (selftest != -1) {
+		if (selftest < 1 || manifest != NULL || trace_mode != TRACE_OFF || workers < 1 || disk != NULL || vm_runs > 1) {
+			fprintf(stderr, "-t needs guests >= 1, -w >= 1 and can not be used with -m, -o/-i, -d or -n\n");
+			return 1;
+		}
+		select_run_loop(bench, 1);
+		return run_selftest(sys_fd, modes != 0 ? modes : CONFIG_MODES, selftest, workers) != 0;
+	}
+	if (manifest != NULL) {
+		if (trace_mode != TRACE_OFF || workers < 1 || disk != NULL) {
+			fprintf(stderr, "-m needs -w >= 1 and can not be used with -o/-i or -d (disk=image in manifest)\n");
 			return 1;
 		}
+		select_run_loop(bench, 1);
+		return run_multi(sys_fd, manifest, workers) != 0;
 	}
 
-	vm_init(&vm, 0x200000); // 0x200000 = 2 << 20 = 2MB this is the memory size (RAM) allocated for the virtual machine.(guest program) we are not running guest OS but we are running guest program because handling OS is big thing so just handle the simple guest program first.
+	vm_init(&vm, sys_fd, vm_size); // 0x200000 = 2 << 20 = 2MB this is the memory size (RAM) allocated for the virtual machine.(guest program) we are not running guest OS but we are running guest program because handling OS is big thing so just handle the simple guest program first.
+	metrics_add_vm(&vm);
+	if (use_irqchip && mode != REAL_MODE) vm_irqchip_init(&vm); // real mode guest has no HALT_PORT.
 	vcpu_init(&vm, &vcpu);
+	if (disk != NULL) blk_open(&vm, disk);
+	select_run_loop(bench, mode != REAL_MODE); // real mode guest does not use file system.
+	if (numa_node >= 0) pin_vcpu_thread(0);
+
+	pthread_t profiler, metrics, self = pthread_self();
+	if (profile_path != NULL) {
+		kick_run = vcpu.kvm_run;
+		kick_init();
+		profile_start(&profiler, &self);
+	}
+	if (metrics_path != NULL) metrics_start(&metrics);
 
+	int ok = 0;
 	switch (mode) {
 	case REAL_MODE:
-		return !run_real_mode(&vm, &vcpu);
+		if (MODE_BUILT_IN(REAL_MODE)) ok = run_real_mode(&vm, &vcpu);
+		break;
 
 	case PROTECTED_MODE:
-		return !run_protected_mode(&vm, &vcpu);
+		if (MODE_BUILT_IN(PROTECTED_MODE)) ok = run_protected_mode(&vm, &vcpu);
+		break;
 
 	case PAGED_32BIT_MODE:
-		return !run_paged_32bit_mode(&vm, &vcpu);
+		if (MODE_BUILT_IN(PAGED_32BIT_MODE)) ok = run_paged_32bit_mode(&vm, &vcpu);
+		break;
 
 	case LONG_MODE:
-		return !run_long_mode(&vm, &vcpu);
+		if (MODE_BUILT_IN(LONG_MODE)) ok = run_long_mode(&vm, &vcpu);
+		break;
 	}
+	crash_wait();
+	lazy_finish(&vm);
+	if (profile_path != NULL) profile_finish(profiler);
+	if (metrics_path != NULL) metrics_finish(metrics);
+	print_memory_stats(&vm);
+	print_io_stats(&vm);
+	print_lazy_stats(&vm);
+	print_fd_pool_stats();
+	if (vm.stats.resets > 0)
+		printf("Host: %lu resets, %lu us each, %lu pages dropped %lu copied\n", vm.stats.resets,
+		       vm.stats.reset_ns / vm.stats.resets / 1000, vm.stats.reset_dropped, vm.stats.reset_copied);
+	if (vm.blk != NULL)
+		printf("Host: disk %lu requests in %lu syscalls, %lu completion batches\n", vm.stats.blk_reqs, vm.stats.blk_syscalls, vm.stats.blk_batches);
 
-	return 1;
+	return !ok;
 }